@@ -7,10 +7,23 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <memory>
 #include "shader/Shader.h"
 #include "simulation/particle.h"
 #include "simulation/shapes.h"
 #include "simulation/particlesystem.h"
+#include "simulation/trajectory_writer.h"
+#include "simulation/trajectory_reader.h"
+#include "simulation/shared_state.h"
+#include "simulation/distributed.h"
+#include "render/camera.h"
+#include "render/particle_renderer.h"
+#include "render/software_rasterizer.h"
+#include "render/density_splat.h"
+#include "render/tree_lod.h"
+#include "render/frame_writer.h"
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
@@ -18,12 +31,71 @@ void processInput(GLFWwindow* window);
 // settings
 const unsigned int SCR_WIDTH = 1920;
 const unsigned int SCR_HEIGHT = 1280;
+const RenderMode RENDER_MODE = RenderMode::points;
+const TimestepMode TIMESTEP_MODE = TimestepMode::fixed;
+const ICPreset INITIAL_CONDITIONS = ICPreset::uniform; // uniform, plummer, exponential_disk or colliding_galaxies
+const unsigned long long SEED = 1; // same seed, same initial conditions
+const char* TUNING_FILE = "tuning.txt"; // solver choice per machine and problem size, written by the autotuner
+
+// picked at compile time, integrator: VelocityVerlet, LeapfrogKDK, LeapfrogDKD or Yoshida4
+// precision: SinglePrecision or MixedPrecision (double positions and force sums, float interactions)
+using Simulation = ParticlesystemT<VelocityVerlet, SinglePrecision>;
+
+int run_headless(int argc, char** argv);
+int run_distributed(int argc, char** argv);
+
+// the simulated system, built only by the modes that simulate, a replay never pays for it
+std::unique_ptr<Simulation> make_simulation()
+{
+    std::unique_ptr<Simulation> system(new Simulation(100000, true, false, InitialConditions(INITIAL_CONDITIONS, SEED)));
+    system->timestep_mode = TIMESTEP_MODE;
+    return system;
+}
 
 // mostly copied from learn-opengl, just like Shader.h, slightly modified
-int main()
+int main(int argc, char** argv)
 {
-    Circle c1(40);
-    Particlesystem s1(100000, true, false);
+    // distributed runs fork their ranks before anything else starts a thread
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--ranks") {
+            return run_distributed(argc, argv);
+        }
+    }
+
+    // batch runs render offscreen on the cpu, no window or display needed
+    std::string replay_path;
+    double seek_time = 0.0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--headless") {
+            return run_headless(argc, argv);
+        }
+        if (arg == "--replay" && i + 1 < argc) replay_path = argv[++i];
+        else if (arg == "--seek" && i + 1 < argc) seek_time = std::stod(argv[++i]);
+    }
+
+    // replay plays a trajectory file instead of simulating, frames are decoded ahead on a background thread
+    TrajectoryReader replay;
+    TrajectoryReader::Frame replay_frame;
+    bool replaying = !replay_path.empty();
+    // a seek only counts on the press of an arrow key, presses before its frame arrived add up on the target
+    double seek_target = 0.0;
+    bool seek_pending = false;
+    bool right_down = false, left_down = false;
+    if (replaying) {
+        if (!replay.open(replay_path)) {
+            return -1;
+        }
+        replay.seek(seek_time);
+        replay.next_frame(replay_frame);
+    }
+
+    // the system only exists when something is simulated, a replay costs no simulation at all
+    std::unique_ptr<Simulation> s1;
+    if (!replaying) {
+        s1 = make_simulation();
+        s1->autotune(TUNING_FILE);
+    }
 
     static double limitFPS = 1 / 1;
 
@@ -67,27 +139,13 @@ int main()
     // -----------------------------
     glEnable(GL_DEPTH_TEST);
 
-    // build and compile our shader zprogram
-    // ------------------------------------
-    Shader ourShader("shader/shader.vert", "shader/shader.frag");
-
-    // set up vertex data (and buffer(s)) and configure vertex attributes
-    // ------------------------------------------------------------------
-
-    // world space positions of our cubes
-
-    unsigned int VBO, VAO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-
-    glBindVertexArray(VAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, c1.vertices.size() * sizeof(float), c1.vertices.data(), GL_STATIC_DRAW);
-    // position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    
+    // build the shaders and the vertex / instance buffers
+    // ---------------------------------------------------
+    ParticleRenderer renderer(RENDER_MODE, 40);
+    Camera camera(SCR_WIDTH, SCR_HEIGHT);
+    DensitySplat splat(SplatWeight::count);
+    Image splat_image;
+    TreeLod lod(1.f);
 
     // render loop
     // -----------
@@ -101,7 +159,9 @@ int main()
 
         while (deltaTime >= 1.0) {
             //update stuff in here
-            s1.update();
+            if (!replaying) {
+                s1->update();
+            }
             updates++;
             deltaTime--;
         }
@@ -109,33 +169,69 @@ int main()
         // -----
         processInput(window);
 
+        // replay: one stored frame per displayed frame if it is decoded, the arrow keys seek, at the end it starts over
+        if (replaying) {
+            double skip = (replay.end_time() - replay.start_time()) / 100.0;
+            bool right = glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS;
+            bool left = glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS;
+            int direction = (right && !right_down ? 1 : 0) - (left && !left_down ? 1 : 0);
+            right_down = right;
+            left_down = left;
+            if (direction != 0) {
+                double from = seek_pending ? seek_target : replay_frame.time;
+                seek_target = std::min(std::max(from + direction * skip, replay.start_time()), replay.end_time());
+                seek_pending = true;
+                replay.seek(seek_target);
+            }
+            if (replay.next_frame(replay_frame, false)) {
+                seek_pending = false;
+            }
+            else if (!seek_pending && replay_frame.time >= replay.end_time()) {
+                replay.seek(replay.start_time());
+            }
+        }
+
         // render
         // ------
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear the depth buffer now!
 
-        // activate shader
-        ourShader.use();
-
-        // create transformations
-        glm::mat4 view = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-        glm::mat4 projection = glm::mat4(1.0f);
-        projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        view = glm::translate(view, glm::vec3(0.0f, 0.0f, -50.0f));
-        // pass transformation matrices to the shader
-        ourShader.setMat4("projection", projection); // note: currently we set the projection matrix each frame, but since the projection matrix rarely changes it's often best practice to set it outside the main loop only once.
-        ourShader.setMat4("view", view);
-
-        // render boxes
-        glBindVertexArray(VAO);
+        // camera follows the framebuffer size
+        int fb_width, fb_height;
+        glfwGetFramebufferSize(window, &fb_width, &fb_height);
+        if (fb_width > 0 && fb_height > 0 && (fb_width != camera.width || fb_height != camera.height)) {
+            camera.resize(fb_width, fb_height);
+        }
 
-        for (Particle &p : s1.particles) {
-            // calculate the model matrix for each object and pass it to shader before drawing
-            glm::mat4 model = glm::mat4(1.f);
-            model = glm::translate(model, p.position);
-            model = glm::scale(model, p.scale);
-            ourShader.setMat4("model", model);
-            glDrawArrays(GL_TRIANGLE_FAN, 0, c1.vertices.size());
+        // render particles, one draw call for all of them
+        if (RENDER_MODE == RenderMode::splat) {
+            if (replaying) {
+                splat.render(replay_frame.particles, camera, splat_image);
+            }
+            else {
+                splat.render(s1->particles, camera, splat_image);
+            }
+            renderer.draw_image(splat_image);
+        }
+        else if (RENDER_MODE == RenderMode::lod && !replaying) {
+            // the tree of the last update is reused, cost follows what is on screen instead of N
+            // the direct solver never builds one, then it is built here for the picture
+            if (s1->solver == ForceSolver::direct) {
+                s1->build_tree();
+            }
+            lod.collect(s1->Qtree, s1->particles, camera, renderer.instance_data);
+            renderer.upload_instance_data();
+            renderer.draw(camera);
+        }
+        else {
+            // a replay has no tree, lod falls back to points
+            if (replaying) {
+                renderer.upload(replay_frame.particles);
+            }
+            else {
+                renderer.upload(s1->particles);
+            }
+            renderer.draw(camera);
         }
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
@@ -147,15 +243,20 @@ int main()
 
         if (glfwGetTime() - timer > 1.0) {
             timer++;
-            std::cout << "FPS: " << frames << " Updates:" << updates << std::endl;
+            if (replaying) {
+                std::cout << "FPS: " << frames << " Replay time: " << replay_frame.time << std::endl;
+            }
+            else {
+                std::cout << "FPS: " << frames << " Updates:" << updates << " Sim time / s: " << s1->cost.simulated_per_wall_second() << std::endl;
+                s1->cost.reset();
+            }
             updates = 0, frames = 0;
         }
     }
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
+    renderer.release();
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
@@ -163,6 +264,257 @@ int main()
     return 0;
 }
 
+// offscreen batch mode: simulates a fixed number of steps and writes every k-th frame
+// usage: --headless [--steps N] [--every K] [--size W H] [--out prefix | --raw] [--splat [mass | speed]]
+//        [--replay file [--seek time]] plays a trajectory instead of simulating
+//        [--publish name [--publish-every K]] shares the latest positions, see simulation/shared_state.h
+// ---------------------------------------------------------------------------------------------------------
+int run_headless(int argc, char** argv)
+{
+    int steps = 1000;
+    int every = 10;
+    int width = SCR_WIDTH;
+    int height = SCR_HEIGHT;
+    std::string prefix = "frame";
+    FrameFormat format = FrameFormat::ppm;
+    bool use_splat = false;
+    SplatWeight weight = SplatWeight::count;
+    std::string restore_path;
+    std::string checkpoint_path;
+    int checkpoint_every = 0;
+    std::string trajectory_path;
+    int trajectory_every = 10;
+    Backpressure backpressure = Backpressure::block;
+    float compress_tolerance = 0.f;
+    std::string replay_path;
+    double seek_time = 0.0;
+    std::string publish_name;
+    int publish_every = 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--steps" && i + 1 < argc) steps = std::stoi(argv[++i]);
+        else if (arg == "--every" && i + 1 < argc) every = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--size" && i + 2 < argc) { width = std::stoi(argv[++i]); height = std::stoi(argv[++i]); }
+        else if (arg == "--out" && i + 1 < argc) prefix = argv[++i];
+        else if (arg == "--raw") format = FrameFormat::raw;
+        else if (arg == "--splat") {
+            use_splat = true;
+            if (i + 1 < argc && std::string(argv[i + 1]) == "mass") { weight = SplatWeight::mass; i++; }
+            else if (i + 1 < argc && std::string(argv[i + 1]) == "speed") { weight = SplatWeight::speed; i++; }
+        }
+        else if (arg == "--restore" && i + 1 < argc) restore_path = argv[++i];
+        else if (arg == "--checkpoint" && i + 1 < argc) checkpoint_path = argv[++i];
+        else if (arg == "--checkpoint-every" && i + 1 < argc) checkpoint_every = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--trajectory" && i + 1 < argc) trajectory_path = argv[++i];
+        else if (arg == "--trajectory-every" && i + 1 < argc) trajectory_every = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--backpressure" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            backpressure = policy == "drop" ? Backpressure::drop : policy == "decimate" ? Backpressure::decimate : Backpressure::block;
+        }
+        else if (arg == "--compress" && i + 1 < argc) compress_tolerance = std::stof(argv[++i]);
+        else if (arg == "--replay" && i + 1 < argc) replay_path = argv[++i];
+        else if (arg == "--seek" && i + 1 < argc) seek_time = std::stod(argv[++i]);
+        else if (arg == "--publish" && i + 1 < argc) publish_name = argv[++i];
+        else if (arg == "--publish-every" && i + 1 < argc) publish_every = std::max(1, std::stoi(argv[++i]));
+    }
+
+    Camera camera(width, height);
+    SoftwareRasterizer rasterizer;
+    DensitySplat splat(weight);
+    FrameWriter writer(format, prefix);
+    Image image;
+
+    auto render = [&](const auto& particles) {
+        if (use_splat) {
+            splat.render(particles, camera, image);
+        }
+        else {
+            rasterizer.draw(particles, camera, image);
+        }
+        writer.push(image);
+    };
+
+    // replay: --steps stored frames from the trajectory file are played, nothing is simulated
+    if (!replay_path.empty()) {
+        TrajectoryReader replay;
+        if (!replay.open(replay_path)) {
+            return -1;
+        }
+        replay.seek(seek_time);
+        TrajectoryReader::Frame frame;
+        int played = 0;
+        while (played < steps && replay.next_frame(frame)) {
+            if (played % every == 0) {
+                render(frame.particles);
+            }
+            played++;
+        }
+        writer.finish();
+        std::cerr << "Replayed: " << played << " of " << replay.frame_count() << " Frames: " << writer.frames_written << std::endl;
+        return 0;
+    }
+
+    std::unique_ptr<Simulation> simulation = make_simulation();
+    Simulation& system = *simulation;
+
+    // stdout may carry the raw video, so progress and diagnostics go to stderr
+    system.diagnostics.out = &std::cerr;
+
+    // a restored run keeps the solver settings it was checkpointed with
+    if (!restore_path.empty()) {
+        if (!system.restore_snapshot(restore_path)) {
+            return -1;
+        }
+        std::cerr << "Restored " << system.amount << " particles at step " << system.step_count << " time " << system.time << std::endl;
+    }
+    else {
+        system.autotune(TUNING_FILE, &std::cerr);
+    }
+
+    // positions and ids every trajectory_every steps, written on a background thread
+    std::unique_ptr<TrajectoryWriter> trajectory;
+    if (!trajectory_path.empty()) {
+        trajectory.reset(new TrajectoryWriter(trajectory_path, trajectory_position | trajectory_id, backpressure));
+        if (compress_tolerance > 0.f) {
+            trajectory->compress = true;
+            trajectory->codec.position_tolerance = compress_tolerance;
+        }
+    }
+
+    // latest positions in shared memory for viewers in other processes, room for the system to double
+    SharedStatePublisher publisher;
+    if (!publish_name.empty()) {
+        publisher.open(publish_name, 2 * (uint64_t)system.alive_count());
+    }
+
+    for (int step = 0; step < steps; step++) {
+        system.update();
+
+        if (!publish_name.empty() && (step + 1) % publish_every == 0) {
+            publisher.publish(system);
+        }
+
+        if (trajectory && (step + 1) % trajectory_every == 0) {
+            trajectory->push(system);
+        }
+        if (!checkpoint_path.empty() && checkpoint_every > 0 && (step + 1) % checkpoint_every == 0) {
+            system.save_snapshot(checkpoint_path);
+        }
+
+        if (step % every == 0) {
+            render(system.particles);
+        }
+    }
+    writer.finish();
+    if (!checkpoint_path.empty()) {
+        system.save_snapshot(checkpoint_path);
+    }
+    if (trajectory) {
+        trajectory->finish();
+        std::cerr << "Trajectory frames: " << trajectory->frames_written << " dropped: " << trajectory->frames_dropped
+            << " MB: " << trajectory->bytes_written / (1024.0 * 1024.0);
+        if (trajectory->compress) {
+            std::cerr << " compression: " << trajectory->codec.ratio() << "x";
+        }
+        std::cerr << std::endl;
+    }
+
+    std::cerr << "Steps: " << steps << " Frames: " << writer.frames_written
+        << " Simulated: " << system.cost.simulated_time << " Sim time / s: " << system.cost.simulated_per_wall_second() << std::endl;
+    return 0;
+}
+
+// distributed batch run: the particles are spread over N processes on this machine, see simulation/distributed.h
+// usage: --ranks N [--particles N] [--steps N] [--every K] [--size W H] [--out prefix | --raw]
+// rank 0 writes the frames, every other rank sends it the image of its own particles
+// ---------------------------------------------------------------------------------------------------------
+int run_distributed(int argc, char** argv)
+{
+    int ranks = 1;
+    int particles = 100000;
+    int steps = 1000;
+    int every = 10;
+    int width = SCR_WIDTH;
+    int height = SCR_HEIGHT;
+    std::string prefix = "frame";
+    FrameFormat format = FrameFormat::ppm;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--ranks" && i + 1 < argc) ranks = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--particles" && i + 1 < argc) particles = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--steps" && i + 1 < argc) steps = std::stoi(argv[++i]);
+        else if (arg == "--every" && i + 1 < argc) every = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--size" && i + 2 < argc) { width = std::stoi(argv[++i]); height = std::stoi(argv[++i]); }
+        else if (arg == "--out" && i + 1 < argc) prefix = argv[++i];
+        else if (arg == "--raw") format = FrameFormat::raw;
+    }
+
+    SocketTransport transport;
+    if (!transport.fork_ranks(ranks)) {
+        return -1;
+    }
+    bool root = transport.rank == 0;
+
+    Distributed system(transport, particles, InitialConditions(INITIAL_CONDITIONS, SEED));
+
+    Camera camera(width, height);
+    SoftwareRasterizer rasterizer;
+    std::unique_ptr<FrameWriter> writer;
+    if (root) {
+        writer.reset(new FrameWriter(format, prefix));
+    }
+    Image image;
+    unsigned char background[3] = { (unsigned char)(rasterizer.background.r * 255), (unsigned char)(rasterizer.background.g * 255), (unsigned char)(rasterizer.background.b * 255) };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    double comm_wait = 0.0;
+    for (int step = 0; step < steps; step++) {
+        if (!system.step()) {
+            std::cerr << "ERROR::DISTRIBUTED::RANK_LOST rank " << transport.rank << " step " << step << std::endl;
+            return -1;
+        }
+        comm_wait += system.comm_wait;
+
+        if (step % every == 0) {
+            rasterizer.draw(system.local.particles, camera, image);
+
+            // rank 0 keeps every pixel another rank drew over the background
+            system.clear_out();
+            if (!root) {
+                system.out[0].assign(image.pixels.begin(), image.pixels.end());
+            }
+            if (!system.exchange(system.out, system.in)) {
+                std::cerr << "ERROR::DISTRIBUTED::RANK_LOST rank " << transport.rank << " step " << step << std::endl;
+                return -1;
+            }
+            if (root) {
+                for (int r = 1; r < transport.size; r++) {
+                    const std::vector<char>& other = system.in[r];
+                    for (size_t k = 0; k + 2 < other.size() && k + 2 < image.pixels.size(); k += 3) {
+                        if ((unsigned char)other[k] != background[0] || (unsigned char)other[k + 1] != background[1] || (unsigned char)other[k + 2] != background[2]) {
+                            image.pixels[k] = other[k];
+                            image.pixels[k + 1] = other[k + 1];
+                            image.pixels[k + 2] = other[k + 2];
+                        }
+                    }
+                }
+                writer->push(image);
+            }
+        }
+    }
+    long long total = system.global_count();
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (root) {
+        writer->finish();
+        std::cerr << "Ranks: " << transport.size << " Particles: " << total << " Steps: " << steps << " Frames: " << writer->frames_written
+            << " Steps / s: " << steps / seconds << " Rank 0 waited on the exchange: " << comm_wait << " s" << std::endl;
+    }
+    return 0;
+}
+
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
 void processInput(GLFWwindow* window)
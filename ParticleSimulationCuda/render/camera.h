@@ -0,0 +1,49 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+
+// the fixed camera looking at the z = 0 plane, shared by the GL and the CPU renderers
+struct Camera {
+	int width;
+	int height;
+	float fov;
+	float distance;
+
+	glm::mat4 view;
+	glm::mat4 projection;
+
+	Camera(int w, int h) : width(w), height(h), fov(45.f), distance(50.f) {
+		update();
+	}
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		update();
+	}
+
+	void update() {
+		projection = glm::perspective(glm::radians(fov), (float)width / (float)height, 0.1f, 100.0f);
+		view = glm::translate(glm::mat4(1.f), glm::vec3(0.0f, 0.0f, -distance));
+	}
+
+	// pixel coordinates (origin top left) and depth of a world position, returns false if it is behind the camera
+	bool to_screen(const glm::vec3& pos, glm::vec2& pixel, float& depth) const {
+		glm::vec4 eye = view * glm::vec4(pos, 1.f);
+		depth = -eye.z;
+		if (depth <= 0.f) {
+			return false;
+		}
+		glm::vec4 clip = projection * eye;
+		pixel.x = (clip.x / clip.w * 0.5f + 0.5f) * width;
+		pixel.y = (0.5f - clip.y / clip.w * 0.5f) * height;
+		return true;
+	}
+
+	// size in pixels of a world length at the given depth
+	float pixels_per_unit(float depth) const {
+		return projection[1][1] * 0.5f * height / depth;
+	}
+};
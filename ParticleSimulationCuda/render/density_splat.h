@@ -0,0 +1,185 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "image.h"
+#include "../simulation/particle.h"
+
+
+enum class SplatWeight {
+	count,	// every particle adds 1
+	mass,	// weighted by particle mass
+	speed	// weighted by |velocity|
+};
+
+// renders particles as a density image instead of discs, for particle counts where discs are pointless
+// every thread bins its share of the particles into its own accumulation grid (no atomics),
+// the grids are then summed row wise and tone mapped into an image
+// one grid of width * height floats per thread, so the thread count is capped at max_threads,
+// the three phases run on the same threads, one spawn per frame, with a barrier in between
+struct DensitySplat {
+
+	static const int max_threads = 8;
+
+	int thread_count;
+	SplatWeight weight;
+	float exposure;
+
+	glm::vec3 background;
+	glm::vec3 color;
+
+	std::vector<std::vector<float>> tiles; //one full size grid per thread
+	std::vector<float> grid;
+	int width, height;
+
+	// the threads of one frame wait here for each other between the phases
+	struct Barrier {
+		std::mutex mutex;
+		std::condition_variable changed;
+		int count;
+		int waiting;
+		long long generation;
+
+		Barrier(int n) : count(n), waiting(0), generation(0) {};
+
+		void wait() {
+			std::unique_lock<std::mutex> lock(mutex);
+			long long arrived = generation;
+			if (++waiting == count) {
+				waiting = 0;
+				generation++;
+				changed.notify_all();
+				return;
+			}
+			changed.wait(lock, [&] { return generation != arrived; });
+		}
+	};
+
+	DensitySplat(SplatWeight w = SplatWeight::count, int threads = 4) :
+		thread_count(glm::clamp(threads, 1, max_threads)),
+		weight(w), exposure(1.f), background(0.2f, 0.3f, 0.3f), color(1.f, 1.f, 1.f), width(0), height(0) {};
+
+	void resize(int w, int h) {
+		if (w == width && h == height && (int)tiles.size() == thread_count) {
+			return;
+		}
+		width = w;
+		height = h;
+		tiles.assign(thread_count, std::vector<float>((size_t)w * h, 0.f));
+		grid.assign((size_t)w * h, 0.f);
+	}
+
+	// bins n particles and tone maps them into image, position(i) returns the world position and
+	// weight_of(i) the weight of particle i, works for any layout, arrays of structs or separate arrays per component
+	template<typename PositionFn, typename WeightFn>
+	void draw(size_t n, const Camera& camera, PositionFn position, WeightFn weight_of, Image& image) {
+
+		resize(camera.width, camera.height);
+		if (image.width != width || image.height != height) {
+			image = Image(width, height);
+		}
+
+		// the view is a pure translation, so projecting is a divide and a scale per particle
+		float scale_x = camera.projection[0][0] * 0.5f * width;
+		float scale_y = camera.projection[1][1] * 0.5f * height;
+		float center_x = 0.5f * width;
+		float center_y = 0.5f * height;
+		glm::vec3 eye_offset = glm::vec3(camera.view[3]);
+
+		size_t partition = (n + thread_count - 1) / thread_count;
+		int rows = (height + thread_count - 1) / thread_count;
+		std::vector<float> row_max(thread_count, 0.f);
+		Barrier barrier(thread_count);
+
+		auto work = [&](int t) {
+			// bin the own particles into the own grid
+			std::vector<float>& tile = tiles[t];
+			std::fill(tile.begin(), tile.end(), 0.f);
+
+			size_t begin = glm::min(n, t * partition);
+			size_t end = glm::min(n, begin + partition);
+
+			for (size_t i = begin; i < end; i++) {
+				glm::vec3 eye = position(i) + eye_offset;
+				if (eye.z >= 0.f) {
+					continue;
+				}
+				float inv_depth = -1.f / eye.z;
+				int x = (int)floorf(center_x + eye.x * scale_x * inv_depth);
+				int y = (int)floorf(center_y - eye.y * scale_y * inv_depth);
+
+				if (x < 0 || y < 0 || x >= width || y >= height) {
+					continue;
+				}
+				tile[(size_t)y * width + x] += weight_of(i);
+			}
+			barrier.wait();
+
+			// sum the grids over the own rows, no two threads touch the same pixel
+			size_t first = (size_t)glm::min(height, t * rows) * width;
+			size_t last = (size_t)glm::min(height, (t + 1) * rows) * width;
+			float local_max = 0.f;
+
+			for (size_t i = first; i < last; i++) {
+				float sum = 0.f;
+				for (int k = 0; k < thread_count; k++) {
+					sum += tiles[k][i];
+				}
+				grid[i] = sum;
+				local_max = glm::max(local_max, sum);
+			}
+			row_max[t] = local_max;
+			barrier.wait();
+
+			float max_value = 0.f;
+			for (float m : row_max) {
+				max_value = glm::max(max_value, m);
+			}
+			// logarithmic tone mapping, so single particles stay visible next to dense clusters
+			float norm = max_value > 0.f ? 1.f / logf(1.f + exposure * max_value) : 0.f;
+
+			for (size_t i = first; i < last; i++) {
+				float v = glm::min(1.f, logf(1.f + exposure * grid[i]) * norm);
+				glm::vec3 c = glm::mix(background, color, v);
+				image.pixels[3 * i + 0] = (unsigned char)(c.r * 255.f);
+				image.pixels[3 * i + 1] = (unsigned char)(c.g * 255.f);
+				image.pixels[3 * i + 2] = (unsigned char)(c.b * 255.f);
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (int t = 1; t < thread_count; t++) {
+			threads.emplace_back(work, t);
+		}
+		work(0);
+		for (std::thread& t : threads) {
+			t.join();
+		}
+	}
+
+	template<typename P>
+	void render(const std::vector<P>& particles, const Camera& camera, Image& image) {
+
+		const P* p = particles.data();
+		auto position = [p](size_t i) { return glm::vec3(p[i].position); };
+
+		switch (weight) {
+		case SplatWeight::count:
+			draw(particles.size(), camera, position, [p](size_t i) { return p[i].alive ? 1.f : 0.f; }, image);
+			break;
+		case SplatWeight::mass:
+			draw(particles.size(), camera, position, [p](size_t i) { return p[i].mass; }, image);
+			break;
+		case SplatWeight::speed:
+			draw(particles.size(), camera, position, [p](size_t i) { return glm::length(p[i].velocity); }, image);
+			break;
+		}
+	}
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "image.h"
+
+
+enum class FrameFormat {
+	ppm,	// one binary ppm file per frame: <prefix>_000042.ppm
+	raw		// raw rgb24 frames on stdout, e.g. | ffmpeg -f rawvideo -pix_fmt rgb24 -s 1920x1280 -i - out.mp4
+};
+
+// encodes and writes frames on its own thread, so the simulation only pays for handing over the image
+// the queue is bounded, if the disk cannot keep up push() waits instead of eating all the memory
+struct FrameWriter {
+
+	FrameFormat format;
+	std::string prefix;
+	size_t max_queued;
+
+	std::deque<Image> queue;
+	std::mutex mutex;
+	std::condition_variable queue_changed;
+	bool stop;
+
+	int frames_written;
+	std::thread worker;
+
+	FrameWriter(FrameFormat f, const std::string& p, size_t max_q = 8) :
+		format(f), prefix(p), max_queued(max_q), stop(false), frames_written(0) {
+
+#ifdef _WIN32
+		if (format == FrameFormat::raw) {
+			_setmode(_fileno(stdout), _O_BINARY);
+		}
+#endif
+		worker = std::thread(&FrameWriter::run, this);
+	}
+
+	~FrameWriter() {
+		finish();
+	}
+
+	// takes ownership of the image, the caller gets an empty one back
+	void push(Image& image) {
+		std::unique_lock<std::mutex> lock(mutex);
+		queue_changed.wait(lock, [this] { return queue.size() < max_queued; });
+		queue.push_back(std::move(image));
+		image = Image();
+		queue_changed.notify_all();
+	}
+
+	// writes the remaining frames and stops the thread
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stop) {
+				return;
+			}
+			stop = true;
+		}
+		queue_changed.notify_all();
+		worker.join();
+	}
+
+	void run() {
+		while (true) {
+			Image image;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queue_changed.wait(lock, [this] { return stop || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				image = std::move(queue.front());
+				queue.pop_front();
+			}
+			queue_changed.notify_all();
+
+			write(image);
+			frames_written++;
+		}
+	}
+
+	void write(const Image& image) {
+		if (format == FrameFormat::raw) {
+			fwrite(image.pixels.data(), 1, image.pixels.size(), stdout);
+			fflush(stdout);
+			return;
+		}
+
+		char number[16];
+		snprintf(number, sizeof(number), "_%06d.ppm", frames_written);
+		std::string path = prefix + number;
+
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			std::cerr << "Failed to open " << path << std::endl;
+			return;
+		}
+		fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+		fwrite(image.pixels.data(), 1, image.pixels.size(), file);
+		fclose(file);
+	}
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+
+// 8 bit rgb image, rows from top to bottom
+struct Image {
+	int width;
+	int height;
+	std::vector<unsigned char> pixels;
+
+	Image() : width(0), height(0), pixels() {};
+
+	Image(int w, int h) : width(w), height(h), pixels((size_t)w * h * 3, 0) {};
+
+	void fill(unsigned char r, unsigned char g, unsigned char b) {
+		for (size_t i = 0; i < pixels.size(); i += 3) {
+			pixels[i + 0] = r;
+			pixels[i + 1] = g;
+			pixels[i + 2] = b;
+		}
+	}
+
+	void set(int x, int y, unsigned char r, unsigned char g, unsigned char b) {
+		unsigned char* p = &pixels[((size_t)y * width + x) * 3];
+		p[0] = r;
+		p[1] = g;
+		p[2] = b;
+	}
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "image.h"
+#include "../shader/Shader.h"
+#include "../simulation/particle.h"
+#include "../simulation/shapes.h"
+
+
+enum class RenderMode {
+	fan,	// instanced triangle fan, resolution picked from the on screen size
+	points,	// one point sprite per particle, disc shaded in the fragment shader
+	lod,	// point sprites, but only what the Quadtree walk (TreeLod) keeps, far away nodes as one splat
+	splat	// density image made on the cpu (DensitySplat), shown as a fullscreen texture
+};
+
+// draws all particles with a single draw call, either as point sprites or as instanced circles
+// or shows an image rendered on the cpu
+struct ParticleRenderer {
+
+	RenderMode mode;
+
+	Shader point_shader;
+	Shader fan_shader;
+	Shader image_shader;
+
+	Circle circle;
+	int max_fan_resolution;
+
+	unsigned int circle_VBO, instance_VBO;
+	unsigned int fan_VAO, point_VAO;
+	unsigned int image_VAO, image_texture;
+
+	std::vector<float> instance_data; //x, y, z, radius, intensity per particle
+	int count;
+	float max_radius;
+
+	ParticleRenderer(RenderMode m, int max_res = 40) :
+		mode(m),
+		point_shader("shader/particle_point.vert", "shader/particle_point.frag"),
+		fan_shader("shader/particle_fan.vert", "shader/shader.frag"),
+		image_shader("shader/screen.vert", "shader/screen.frag"),
+		circle(max_res), max_fan_resolution(max_res), count(0), max_radius(0.f) {
+
+		glGenBuffers(1, &circle_VBO);
+		glGenBuffers(1, &instance_VBO);
+		glGenVertexArrays(1, &fan_VAO);
+		glGenVertexArrays(1, &point_VAO);
+		glGenVertexArrays(1, &image_VAO);
+		glGenTextures(1, &image_texture);
+
+		upload_circle();
+
+		// fan: per vertex circle outline, per instance position and radius
+		glBindVertexArray(fan_VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, circle_VBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribDivisor(1, 1);
+
+		// points: the same instance buffer read as plain vertices
+		glBindVertexArray(point_VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(4 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+
+		glBindVertexArray(0);
+
+		glBindTexture(GL_TEXTURE_2D, image_texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		// lets the vertex shader set gl_PointSize
+		glEnable(GL_PROGRAM_POINT_SIZE);
+	}
+
+	// needs the GL context, so it has to be called before glfwTerminate
+	void release() {
+		glDeleteVertexArrays(1, &fan_VAO);
+		glDeleteVertexArrays(1, &point_VAO);
+		glDeleteVertexArrays(1, &image_VAO);
+		glDeleteTextures(1, &image_texture);
+		glDeleteBuffers(1, &circle_VBO);
+		glDeleteBuffers(1, &instance_VBO);
+	}
+
+	void upload_circle() {
+		glBindBuffer(GL_ARRAY_BUFFER, circle_VBO);
+		glBufferData(GL_ARRAY_BUFFER, circle.vertices.size() * sizeof(float), circle.vertices.data(), GL_STATIC_DRAW);
+	}
+
+	// copies the positions and radii of the particles into the instance buffer, once per frame
+	// removed particles (tombstones) are left out
+	template<typename P>
+	void upload(const std::vector<P>& particles) {
+		instance_data.resize(particles.size() * 5);
+		size_t i = 0;
+
+		for (const P& p : particles) {
+			if (!p.alive) {
+				continue;
+			}
+			instance_data[5 * i + 0] = (float)p.position.x;
+			instance_data[5 * i + 1] = (float)p.position.y;
+			instance_data[5 * i + 2] = (float)p.position.z;
+			instance_data[5 * i + 3] = p.radius;
+			instance_data[5 * i + 4] = 1.f;
+			i++;
+		}
+		instance_data.resize(i * 5);
+		upload_instance_data();
+	}
+
+	// uploads instance_data as it is, for callers that fill it themselves (TreeLod)
+	void upload_instance_data() {
+		count = (int)instance_data.size() / 5;
+		max_radius = 0.f;
+		for (int i = 0; i < count; i++) {
+			if (instance_data[5 * i + 3] > max_radius) {
+				max_radius = instance_data[5 * i + 3];
+			}
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+		//orphan the old buffer so the driver does not have to wait for the previous frame
+		glBufferData(GL_ARRAY_BUFFER, instance_data.size() * sizeof(float), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, instance_data.size() * sizeof(float), instance_data.data());
+	}
+
+	void draw(const Camera& camera) {
+
+		if (count == 0) {
+			return;
+		}
+
+		if (mode == RenderMode::points || mode == RenderMode::lod) {
+			point_shader.use();
+			point_shader.setMat4("projection", camera.projection);
+			point_shader.setMat4("view", camera.view);
+			point_shader.setFloat("viewport_height", (float)camera.height);
+
+			glBindVertexArray(point_VAO);
+			glDrawArrays(GL_POINTS, 0, count);
+		}
+		else {
+			// the fan only gets as many vertices as the largest particle needs on screen, particles live in z = 0
+			int res = Circle::lod_resolution(max_radius * camera.pixels_per_unit(camera.distance), 0.5f, 3, max_fan_resolution);
+			if (circle.set_resolution(res)) {
+				upload_circle();
+			}
+
+			fan_shader.use();
+			fan_shader.setMat4("projection", camera.projection);
+			fan_shader.setMat4("view", camera.view);
+
+			glBindVertexArray(fan_VAO);
+			glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, (int)circle.vertices.size() / 3, count);
+		}
+		glBindVertexArray(0);
+	}
+
+	// uploads a cpu rendered image and stretches it over the whole viewport
+	void draw_image(const Image& image) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, image_texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, image.width, image.height, 0, GL_RGB, GL_UNSIGNED_BYTE, image.pixels.data());
+
+		image_shader.use();
+		image_shader.setInt("image", 0);
+
+		glDisable(GL_DEPTH_TEST);
+		glBindVertexArray(image_VAO);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+		glEnable(GL_DEPTH_TEST);
+	}
+};
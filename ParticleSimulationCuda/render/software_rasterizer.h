@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "image.h"
+#include "../simulation/particle.h"
+
+
+// draws the particles as filled discs into an image on the cpu, same look as the GL point sprites
+// used for offscreen rendering where no display / GL context is available
+struct SoftwareRasterizer {
+
+	glm::vec3 background;
+	glm::vec3 color;
+
+	SoftwareRasterizer() : background(0.2f, 0.3f, 0.3f), color(1.f, 1.f, 1.f) {};
+
+	template<typename P>
+	void draw(const std::vector<P>& particles, const Camera& camera, Image& image) {
+
+		if (image.width != camera.width || image.height != camera.height) {
+			image = Image(camera.width, camera.height);
+		}
+		image.fill((unsigned char)(background.r * 255), (unsigned char)(background.g * 255), (unsigned char)(background.b * 255));
+
+		unsigned char r = (unsigned char)(color.r * 255);
+		unsigned char g = (unsigned char)(color.g * 255);
+		unsigned char b = (unsigned char)(color.b * 255);
+
+		glm::vec2 pixel;
+		float depth;
+
+		for (const P& p : particles) {
+			if (!p.alive || !camera.to_screen(glm::vec3(p.position), pixel, depth)) {
+				continue;
+			}
+
+			// same rule as the point sprite, at least one pixel
+			float radius_px = p.radius * camera.pixels_per_unit(depth);
+			if (radius_px < 0.71f) {
+				int x = (int)floorf(pixel.x);
+				int y = (int)floorf(pixel.y);
+				if (x >= 0 && y >= 0 && x < image.width && y < image.height) {
+					image.set(x, y, r, g, b);
+				}
+				continue;
+			}
+
+			int x0 = (int)floorf(pixel.x - radius_px);
+			int x1 = (int)ceilf(pixel.x + radius_px);
+			int y0 = (int)floorf(pixel.y - radius_px);
+			int y1 = (int)ceilf(pixel.y + radius_px);
+
+			if (x1 < 0 || y1 < 0 || x0 >= image.width || y0 >= image.height) {
+				continue;
+			}
+			x0 = glm::max(x0, 0);
+			y0 = glm::max(y0, 0);
+			x1 = glm::min(x1, image.width - 1);
+			y1 = glm::min(y1, image.height - 1);
+
+			float r_sq = radius_px * radius_px;
+
+			for (int y = y0; y <= y1; y++) {
+				float dy = y + 0.5f - pixel.y;
+				for (int x = x0; x <= x1; x++) {
+					float dx = x + 0.5f - pixel.x;
+					if (dx * dx + dy * dy <= r_sq) {
+						image.set(x, y, r, g, b);
+					}
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "../simulation/particle.h"
+#include "../simulation/BarnesHut.h"
+
+
+// walks the Quadtree against the camera to decide what actually has to be drawn
+// nodes outside the screen are culled, nodes smaller than min_node_px on screen are drawn as one splat
+// at their center of mass with the mass as intensity, only the remaining leaves are drawn as particles
+// the output uses the ParticleRenderer instance layout: x, y, z, radius, intensity
+struct TreeLod {
+
+	float min_node_px;
+
+	int culled_nodes;
+	int splats;
+	int expanded_particles;
+
+	TreeLod(float min_px = 1.f) : min_node_px(min_px), culled_nodes(0), splats(0), expanded_particles(0) {};
+
+	template<typename Tree, typename P>
+	void collect(const Tree& tree, const std::vector<P>& particles, const Camera& camera, std::vector<float>& instances) {
+		instances.clear();
+		culled_nodes = 0;
+		splats = 0;
+		expanded_particles = 0;
+
+		if (tree.nodes.empty() || tree.nodes[tree.root].mass == 0) {
+			return;
+		}
+		walk(tree, tree.root, particles, camera, instances);
+	}
+
+	template<typename Tree, typename P>
+	void walk(const Tree& tree, int current_node, const std::vector<P>& particles, const Camera& camera, std::vector<float>& instances) {
+
+		const typename Tree::Node& node = tree.nodes[current_node];
+
+		if (node.mass == 0) {
+			return;
+		}
+
+		// screen rectangle of the nodes box
+		float half = node.quad.size * 0.5f;
+		glm::vec2 corner_min, corner_max;
+		float depth_min, depth_max;
+		if (!camera.to_screen(node.quad.center + glm::vec3(-half, -half, 0.f), corner_min, depth_min) ||
+			!camera.to_screen(node.quad.center + glm::vec3(half, half, 0.f), corner_max, depth_max)) {
+			culled_nodes++;
+			return;
+		}
+		// y is flipped on screen, so the top of the box is corner_max.y
+		if (corner_max.x < 0.f || corner_min.x > camera.width || corner_min.y < 0.f || corner_max.y > camera.height) {
+			culled_nodes++;
+			return;
+		}
+
+		if (node.is_leaf) {
+			if (node.body >= 0) {
+				const P& p = particles[node.body];
+				push(instances, glm::vec3(p.position), p.radius, 1.f);
+				expanded_particles++;
+			}
+			return;
+		}
+
+		// whole node covers less than a pixel, one splat at its center of mass
+		if (corner_max.x - corner_min.x < min_node_px) {
+			push(instances, glm::vec3(node.com()), half, node.mass);
+			splats++;
+			return;
+		}
+
+		for (int i = 0; i < 4; i++) {
+			walk(tree, node.children + i, particles, camera, instances);
+		}
+	}
+
+	void push(std::vector<float>& instances, const glm::vec3& pos, float radius, float intensity) {
+		instances.push_back(pos.x);
+		instances.push_back(pos.y);
+		instances.push_back(pos.z);
+		instances.push_back(radius);
+		instances.push_back(intensity);
+	}
+};
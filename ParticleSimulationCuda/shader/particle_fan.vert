@@ -0,0 +1,12 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec4 aInstance; // xyz = particle position, w = radius
+
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * view * vec4(aInstance.xyz + aPos * aInstance.w, 1.0f);
+    }
\ No newline at end of file
@@ -0,0 +1,15 @@
+#version 330 core
+in float Intensity;
+out vec4 FragColor;
+
+void main()
+{
+    // the point is a square sprite, the disc is cut out analytically
+    vec2 d = gl_PointCoord * 2.0f - 1.0f;
+    if (dot(d, d) > 1.0f)
+        discard;
+
+    // single particles stay white, aggregated nodes get warmer the more mass they stand for
+    float heat = clamp(log2(max(Intensity, 1.0f)) / 10.0f, 0.0f, 1.0f);
+    FragColor = vec4(mix(vec3(1.f, 1.f, 1.f), vec3(1.f, 0.6f, 0.2f), heat), 0.0);
+    }
\ No newline at end of file
@@ -0,0 +1,21 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in float aRadius;
+layout (location = 2) in float aIntensity; // 1 for a particle, the mass for an aggregated tree node
+
+out float Intensity;
+
+uniform mat4 view;
+uniform mat4 projection;
+uniform float viewport_height;
+
+void main()
+{
+    vec4 eye = view * vec4(aPos, 1.0f);
+    gl_Position = projection * eye;
+
+    // projection[1][1] = cot(fov / 2), so this is the radius in pixels at the particles depth
+    float radius_px = aRadius * projection[1][1] * 0.5f * viewport_height / -eye.z;
+    gl_PointSize = max(2.0f * radius_px, 1.0f);
+    Intensity = aIntensity;
+    }
\ No newline at end of file
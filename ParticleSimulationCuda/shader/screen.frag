@@ -0,0 +1,10 @@
+#version 330 core
+in vec2 TexCoord;
+out vec4 FragColor;
+
+uniform sampler2D image;
+
+void main()
+{
+    FragColor = vec4(texture(image, TexCoord).rgb, 1.0f);
+    }
\ No newline at end of file
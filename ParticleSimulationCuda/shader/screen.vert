@@ -0,0 +1,10 @@
+#version 330 core
+out vec2 TexCoord;
+
+// fullscreen triangle, no vertex buffer needed
+void main()
+{
+    vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    TexCoord = vec2(pos.x, 1.0f - pos.y);
+    gl_Position = vec4(pos * 2.0f - 1.0f, 0.0f, 1.0f);
+    }
\ No newline at end of file
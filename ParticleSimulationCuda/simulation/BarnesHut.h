@@ -1,6 +1,9 @@
 #pragma once
 #include <vector>
+#include <cmath>
 #include <glm/glm.hpp>
+#include "precision.h"
+#include "node_arena.h"
 
 
 /*contains the bounding box of a node
@@ -77,16 +80,41 @@ struct Quad {
 };
 
 //contains information about the indices of its children
-struct Node {
+//the mass moment (center_mass, mass weighted sum of the positions) is kept in position precision
+template<typename Precision = SinglePrecision>
+struct NodeT {
+	using position_t = typename Precision::position_t;
+
 	int children; //index of the children in the nodes array
 	int parent;
+	int body; //index of the particle in a filled leaf, -1 otherwise
 	bool is_leaf; //true = leaf, false = branch
 
-	glm::vec3 center_mass;
+	position_t center_mass;
 	float mass;
 	Quad quad;
 
-	Node() : children(0), mass(0.f), quad(), is_leaf(true), center_mass(0.f), parent(0) {};
+	//box around the discs of all bodies below the node, bodies outside of the root quad included
+	glm::vec2 bound_min;
+	glm::vec2 bound_max;
+
+	NodeT() : children(0), mass(0.f), quad(), is_leaf(true), center_mass(0.f), parent(0), body(-1), bound_min(INFINITY), bound_max(-INFINITY) {};
+
+	void extend_bounds(glm::vec2 p, float radius) {
+		bound_min = glm::min(bound_min, p - radius);
+		bound_max = glm::max(bound_max, p + radius);
+	}
+
+	// squared distance from p to the bounds, 0 inside
+	float bounds_distance_sq(glm::vec2 p) const {
+		glm::vec2 d = glm::max(glm::max(bound_min - p, p - bound_max), glm::vec2(0.f));
+		return glm::dot(d, d);
+	}
+
+	// actual center of mass, center_mass only holds the mass weighted sum of the positions
+	position_t com() const {
+		return center_mass / (typename position_t::value_type)mass;
+	}
 
 	//check if the body is sufficently far away from the nodes center of mass to split
 	bool check_criterion(glm::vec3 pos_body, float theta) {
@@ -104,41 +132,67 @@ struct Node {
 	}
 };
 
-struct Quadtree {
+template<typename Precision = SinglePrecision>
+struct QuadtreeT {
+	using Node = NodeT<Precision>;
+	using position_t = typename Precision::position_t;
+	using accumulator_t = typename Precision::accumulator_t;
 
 	const int root = 0;
 
-	std::vector<Node> nodes;
+	NodeArena<Node> nodes;
 	std::vector<int> parents;
 
 	std::vector <bool> blocked_parents; //not needed for the final use
 
 	float gravitational_constant;
+	float softening; //epsilon, interactions use d^2 + epsilon^2
 	float theta;
 	float min_Quad_size; //sets the smallest size of a quad, not implemented
 
-	Quadtree() : nodes(), parents(), gravitational_constant(0.00001f), theta(0.9f), min_Quad_size(0.01f) { init_root_node(); };
+	QuadtreeT() : nodes(), parents(), gravitational_constant(0.00001f), softening(0.1f), theta(0.9f), min_Quad_size(0.01f) { init_root_node(); };
+
+	// nodes for a tree of n bodies, with one body per leaf every preset needs about 2.9 nodes per body
+	static size_t predict_nodes(size_t bodies) {
+		return bodies * 13 / 4 + 64;
+	}
+
+	// empties the tree for the next build, the arena is sized once for the prediction or the last tree,
+	// whichever is larger, so the inserts never reallocate while the bodies move
+	void reset(glm::vec3 center, float size, size_t bodies) {
+		size_t last = nodes.size();
+		nodes.reserve(glm::max(predict_nodes(bodies), last + last / 8));
+		nodes.clear();
+		init_root_node(center, size);
+	}
 
-	void init_root_node() {
+	// the root has to contain every body, bodies outside of it can not be told apart by subdividing
+	void init_root_node(glm::vec3 center = glm::vec3(0.f), float size = 100.f) {
 		Node root_node = Node();
-		root_node.quad.center = glm::vec3(0.f);
-		root_node.quad.size = 100.f;
+		root_node.quad.center = center;
+		root_node.quad.size = size;
 		nodes.push_back(root_node);
 	}
 
 	// recursively inserts a point into the quadtree, either expands it or adds it to node
-	void insert(glm::vec3 &pos, float mass) {
+	// index is the particles index, kept in the leaf so the tree can be mapped back to the particles
+	// radius only goes into the bounds, for the neighbour queries
+	void insert(position_t &pos, float mass, int index = -1, float radius = 0.f) {
 
 		int current_node = root;
+		glm::vec2 pos_2d = glm::vec2(pos);
+		// the particles all have mass 1, pseudo particles of other ranks (distributed.h) carry the mass of a whole node
+		typename position_t::value_type m = mass;
 
 		//navigates down the existing internal / non leaf nodes and updates them until a leaf node is reached
 		while (!nodes[current_node].is_leaf) {
 			nodes[current_node].mass += mass;
-			nodes[current_node].center_mass.x + pos.x;
-			nodes[current_node].center_mass.y + pos.y;
+			nodes[current_node].center_mass.x += pos.x * m;
+			nodes[current_node].center_mass.y += pos.y * m;
+			nodes[current_node].extend_bounds(pos_2d, radius);
 
 			//find the index of the child node representing the right quadrant for the point
-			int quadrant = nodes[current_node].quad.find_quadrant(pos);
+			int quadrant = nodes[current_node].quad.find_quadrant(glm::vec3(pos));
 
 			current_node = nodes[current_node].children + quadrant;
 		}
@@ -149,7 +203,9 @@ struct Quadtree {
 			// if the leaf node is empty, the point is added to it
 			if (nodes[current_node].mass == 0) {
 				nodes[current_node].mass += mass;
-				nodes[current_node].center_mass += pos;
+				nodes[current_node].center_mass += pos * m;
+				nodes[current_node].body = index;
+				nodes[current_node].extend_bounds(pos_2d, radius);
 				return;
 			}
 
@@ -168,25 +224,62 @@ struct Quadtree {
 
 			//previously to current node attached point is passed down to the appropiate child node, since current node is not a leaf node anymore 
 
-			Node& pass_child = nodes[nodes[current_node].children + nodes[current_node].quad.find_quadrant(nodes[current_node].center_mass)];
+			Node& pass_child = nodes[nodes[current_node].children + nodes[current_node].quad.find_quadrant(glm::vec3(nodes[current_node].com()))];
 			pass_child.center_mass.x = nodes[current_node].center_mass.x;
 			pass_child.center_mass.y = nodes[current_node].center_mass.y;
 			pass_child.mass = nodes[current_node].mass;
+			pass_child.body = nodes[current_node].body;
+			pass_child.bound_min = nodes[current_node].bound_min;
+			pass_child.bound_max = nodes[current_node].bound_max;
+			nodes[current_node].body = -1;
 
 			//update center of mass and mass, of parent node
 			nodes[current_node].mass += mass;
-			nodes[current_node].center_mass.x += pos.x;
-			nodes[current_node].center_mass.y += pos.y;
+			nodes[current_node].center_mass.x += pos.x * m;
+			nodes[current_node].center_mass.y += pos.y * m;
+			nodes[current_node].extend_bounds(pos_2d, radius);
 
 			//the child node with the correct quadrant becomes the new current node
-			current_node = nodes[current_node].quad.find_quadrant(pos) + nodes[current_node].children;
+			current_node = nodes[current_node].quad.find_quadrant(glm::vec3(pos)) + nodes[current_node].children;
 		}
 
 	}
 
 
+	// keeps the structure and recomputes mass moments and bounds from the current positions of the bodies
+	// children always come after their parent in nodes, so one backward sweep sees them before the parent
+	// the quads stay where they were, a body that drifted out of its quad is still summed where it belongs,
+	// only the opening criterion gets a little looser, fine for the few short substeps between two builds
+	template<typename P>
+	void refit(const std::vector<P>& particles) {
+		for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+			Node& node = nodes[i];
+			if (node.is_leaf) {
+				if (node.body >= 0) {
+					const P& p = particles[node.body];
+					node.center_mass = p.position * (typename position_t::value_type)node.mass;
+					node.bound_min = glm::vec2(INFINITY);
+					node.bound_max = glm::vec2(-INFINITY);
+					node.extend_bounds(glm::vec2(p.position), p.radius);
+				}
+				continue;
+			}
+			node.center_mass.x = 0;
+			node.center_mass.y = 0;
+			node.bound_min = glm::vec2(INFINITY);
+			node.bound_max = glm::vec2(-INFINITY);
+			for (int c = 0; c < 4; c++) {
+				const Node& child = nodes[node.children + c];
+				node.center_mass.x += child.center_mass.x;
+				node.center_mass.y += child.center_mass.y;
+				node.bound_min = glm::min(node.bound_min, child.bound_min);
+				node.bound_max = glm::max(node.bound_max, child.bound_max);
+			}
+		}
+	}
+
 	//horrible N^K way to traverse the tree and calculate forces, not used
-	glm::vec3 calc_forces(glm::vec3 &pos, float mass) {
+	glm::vec3 calc_forces(position_t &pos, float mass) {
 
 		float distance = 0.f;
 		glm::vec3 direction_vector(0.f);
@@ -202,7 +295,7 @@ struct Quadtree {
 			//And check if Node has been approximated by parent node
 			if (!blocked_parents[current_node] && nodes[current_node].mass > 0.9f) {
 
-				direction_vector = (nodes[current_node].center_mass / nodes[current_node].mass) - pos; //Vector pointing from Body to Nodes center of mass
+				direction_vector = glm::vec3(nodes[current_node].com() - pos); //Vector pointing from Body to Nodes center of mass
 				distance = glm::length(direction_vector);
 
 				if (distance == 0) {
@@ -228,7 +321,10 @@ struct Quadtree {
 
 	//Nice optimal n * log(n) way to traverse
 	//tree is recursively traversed until the leaf nodes are reached or the node is sufficently far away from the point to approximate
-	void traverse_tree(int current_node, glm::vec3 &pos, glm::vec3 &acceleration) {
+	// the direction is taken relative to the body and evaluated in float, the sum is kept in accumulator_t
+	// WithPotential also sums the potential of the body, only done on the steps the diagnostics need it
+	template<bool WithPotential>
+	void traverse_tree(int current_node, position_t &pos, accumulator_t &acceleration, double &potential) {
 
 		// goes into the indices of the nodes children
 		for (int i = 0; i < 4; i++) {
@@ -241,7 +337,7 @@ struct Quadtree {
 			}
 
 			// calculate distance direction vector to get the distance and to be used for the force calculation
-			glm::vec3 direction_vector = (nodes[child_id].center_mass / nodes[child_id].mass) - pos; //Vector pointing from Body to Nodes center of mass
+			glm::vec3 direction_vector = glm::vec3(nodes[child_id].com() - pos); //Vector pointing from Body to Nodes center of mass
 			float distance = glm::length(direction_vector);
 
 			//check against nodes center of mass instead? Avoids prior direction vector calculation
@@ -250,14 +346,12 @@ struct Quadtree {
 			}
 			
 			//if a leaf node is reached, the force / acceleration is calculated
-			if (nodes[child_id].is_leaf) {
-				acceleration += calc_acceleration(1.f, nodes[child_id].mass, distance, direction_vector);
-				continue;
-			}
-
 			//if the node is sufficently far away, treat the node as single body to approximate the force
-			if ((nodes[child_id].quad.size / distance) < theta) {
-				acceleration += calc_acceleration(1.f, nodes[child_id].mass, distance, direction_vector);
+			if (nodes[child_id].is_leaf || (nodes[child_id].quad.size / distance) < theta) {
+				acceleration += accumulator_t(calc_acceleration(1.f, nodes[child_id].mass, distance, direction_vector));
+				if (WithPotential) {
+					potential += calc_potential(nodes[child_id].mass, distance);
+				}
 				continue;
 			}
 			else {
@@ -265,29 +359,182 @@ struct Quadtree {
 				//current_node = child_id breaks the recursion loop when traversing from child to parent. As the loop for the parent has now the ID of the child as its current node
 				//current_node = child_id;
 				
-				traverse_tree(child_id, pos, acceleration);
+				traverse_tree<WithPotential>(child_id, pos, acceleration, potential);
 			}
 		}
 	}
 
-	glm::vec3 calc_forces_fast(glm::vec3& pos, float mass) {
-		glm::vec3 acceleration(0.f);
+	glm::vec3 calc_forces_fast(position_t& pos, float mass) {
+		accumulator_t acceleration(0.f);
+		double unused = 0.0;
 		int current_node = 0;
 
-		traverse_tree(current_node, pos, acceleration);
+		traverse_tree<false>(current_node, pos, acceleration, unused);
 
-		return acceleration;
+		return glm::vec3(acceleration);
+	}
+
+	// same walk, also returns the potential at pos (per unit mass of the body)
+	glm::vec3 calc_forces_potential(position_t& pos, float mass, float& potential) {
+		accumulator_t acceleration(0.f);
+		double phi = 0.0;
+
+		traverse_tree<true>(root, pos, acceleration, phi);
+
+		potential = (float)phi;
+		return glm::vec3(acceleration);
+	}
+
+
+	// neighbour query, calls fn(body) for every body whose bounds come closer than radius to pos
+	// the bounds are the box around the disc, so fn gets a superset and does the exact test itself
+	template<typename Fn>
+	void for_each_within(const position_t& pos, float radius, const Fn& fn, int current_node = 0) const {
+		const Node& node = nodes[current_node];
+
+		if (node.bounds_distance_sq(glm::vec2(pos)) >= radius * radius) {
+			return;
+		}
+		if (node.is_leaf) {
+			if (node.body >= 0) {
+				fn(node.body);
+			}
+			return;
+		}
+		for (int i = 0; i < 4; i++) {
+			for_each_within(pos, radius, fn, node.children + i);
+		}
+	}
+
+	// batched query as a dual tree walk, much cheaper than one for_each_within per body
+	// calls fn(i, j) once for every pair of bodies whose bounds come closer than margin
+	// task (a, a) covers the pairs inside node a, task (a, b) the pairs between two disjoint nodes
+	template<typename Fn>
+	void for_each_pair(glm::ivec2 task, float margin, const Fn& fn) const {
+		if (task.x == task.y) {
+			const Node& node = nodes[task.x];
+			if (node.is_leaf) {
+				return;
+			}
+			for (int i = 0; i < 4; i++) {
+				for_each_pair(glm::ivec2(node.children + i), margin, fn);
+				for (int j = i + 1; j < 4; j++) {
+					for_each_pair(glm::ivec2(node.children + i, node.children + j), margin, fn);
+				}
+			}
+			return;
+		}
+
+		const Node& a = nodes[task.x];
+		const Node& b = nodes[task.y];
+
+		// empty nodes have inverted bounds and never overlap anything
+		glm::vec2 gap = glm::max(a.bound_min - b.bound_max, b.bound_min - a.bound_max);
+		if (gap.x >= margin || gap.y >= margin) {
+			return;
+		}
+
+		if (a.is_leaf && b.is_leaf) {
+			fn(a.body, b.body);
+			return;
+		}
+
+		// open the larger node
+		if (b.is_leaf || (!a.is_leaf && a.quad.size >= b.quad.size)) {
+			for (int i = 0; i < 4; i++) {
+				for_each_pair(glm::ivec2(a.children + i, task.y), margin, fn);
+			}
+		}
+		else {
+			for (int i = 0; i < 4; i++) {
+				for_each_pair(glm::ivec2(task.x, b.children + i), margin, fn);
+			}
+		}
+	}
+
+	// splits the whole tree into for_each_pair tasks, levels deep, so threads can take them one by one
+	std::vector<glm::ivec2> pair_tasks(int levels, float margin) const {
+		std::vector<glm::ivec2> tasks(1, glm::ivec2(root));
+
+		for (int level = 0; level < levels; level++) {
+			std::vector<glm::ivec2> next;
+
+			for (glm::ivec2 task : tasks) {
+				const Node& a = nodes[task.x];
+				const Node& b = nodes[task.y];
+
+				if (task.x == task.y && !a.is_leaf) {
+					for (int i = 0; i < 4; i++) {
+						next.push_back(glm::ivec2(a.children + i));
+						for (int j = i + 1; j < 4; j++) {
+							next.push_back(glm::ivec2(a.children + i, a.children + j));
+						}
+					}
+				}
+				else if (task.x != task.y && !a.is_leaf && !b.is_leaf) {
+					glm::vec2 gap = glm::max(a.bound_min - b.bound_max, b.bound_min - a.bound_max);
+					if (gap.x >= margin || gap.y >= margin) {
+						continue;
+					}
+					for (int i = 0; i < 4; i++) {
+						for (int j = 0; j < 4; j++) {
+							next.push_back(glm::ivec2(a.children + i, b.children + j));
+						}
+					}
+				}
+				else {
+					next.push_back(task);
+				}
+			}
+			tasks.swap(next);
+		}
+		return tasks;
+	}
+
+	// exact disc test on the candidate pairs of one task, found gets (i, j) with i < j
+	// slack covers how far the bodies moved since the tree was built, see max_drift
+	template<typename P>
+	void find_contacts(const std::vector<P>& particles, glm::ivec2 task, float slack, std::vector<glm::ivec2>& found) const {
+		for_each_pair(task, 2.f * slack, [&](int i, int j) {
+			glm::vec3 d = glm::vec3(particles[j].position - particles[i].position);
+			float r = particles[i].radius + particles[j].radius;
+			if (glm::dot(d, d) < r * r) {
+				found.push_back(i < j ? glm::ivec2(i, j) : glm::ivec2(j, i));
+			}
+		});
+	}
+
+	// largest distance a body moved since it was inserted, the leaves still hold the old positions
+	template<typename P>
+	float max_drift(const std::vector<P>& particles) const {
+		float max_sq = 0.f;
+		for (const Node& node : nodes) {
+			if (node.is_leaf && node.body >= 0) {
+				glm::vec3 d = glm::vec3(particles[node.body].position - node.com());
+				max_sq = glm::max(max_sq, glm::dot(d, d));
+			}
+		}
+		return sqrtf(max_sq);
 	}
 
 
 	//gravitational constant in Quadtree is nonsense, should be in ParticleSystem
+	//the pull is linear in the node mass, d is already known so the direction needs no extra normalize
 	glm::vec3 calc_acceleration(float mb, float mn, float d, glm::vec3 &d_v) {
 
-		float acceleration_scalar = gravitational_constant * (mn * mn) / ((d * d) + 0.01);
+		float acceleration_scalar = gravitational_constant * mn / ((d * d) + softening * softening);
 
-		glm::vec3 norm = glm::normalize(d_v);
+		return (acceleration_scalar / d) * d_v;
+	}
 
-		return acceleration_scalar * norm;
+	//potential that belongs to the force above: -dphi/dd = G * mn / (d^2 + eps^2)
+	//phi = -G * mn / eps * (pi / 2 - atan(d / eps)), becomes -G * mn / d far away
+	float calc_potential(float mn, float d) {
+		const float half_pi = 1.57079632679f;
+		return -gravitational_constant * mn / softening * (half_pi - atanf(d / softening));
 	}
 
-};
\ No newline at end of file
+};
+
+using Node = NodeT<>;
+using Quadtree = QuadtreeT<>;
\ No newline at end of file
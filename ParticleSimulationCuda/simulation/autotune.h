@@ -0,0 +1,167 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "direct_sum.h"
+
+
+// what the autotuner picked
+struct Tuning {
+	ForceSolver solver;
+	float theta;
+	double error;	//mean relative force error on the sample, against the exact direct sum
+	double seconds;	//one force pass
+
+	Tuning() : solver(ForceSolver::tree), theta(0.9f), error(0.0), seconds(0.0) {};
+};
+
+/* picks the force solver and the opening angle of the tree for the current system and machine
+	the force error is measured on a fixed sample of bodies against exact direct sums,
+	the largest theta that stays below target_error wins (it opens the fewest nodes),
+	then a trial force pass of the tree and, for small n, of the direct sum is timed and the faster one is kept
+	the result goes into a small text file keyed by machine, problem size and precision, so later runs start tuned
+	there is no multipole solver, no leaf bucket and a fixed split into 4 threads here, so those are not tuned
+*/
+struct Autotuner {
+
+	double target_error;
+	int sample_size;
+	int max_direct; //above this many bodies the direct sum is not even tried
+	std::ostream* out; //nullptr = quiet
+
+	Autotuner() : target_error(0.01), sample_size(256), max_direct(20000), out(&std::cout) {};
+
+	// problem sizes are bucketed by powers of two
+	std::string key(int n, int position_bits) const {
+		int bucket = 1;
+		while (bucket * 2 <= n) {
+			bucket *= 2;
+		}
+		std::ostringstream k;
+		k << "threads" << std::thread::hardware_concurrency() << "_n" << bucket << "_pos" << position_bits << "_err" << target_error;
+		return k.str();
+	}
+
+	// the last entry for the key wins, a missing file just means nothing is tuned yet
+	bool load(const std::string& file, const std::string& wanted, Tuning& tuning) const {
+		std::ifstream in(file);
+		std::string line;
+		bool found = false;
+
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string entry, solver;
+			Tuning t;
+			if (!(fields >> entry >> solver >> t.theta >> t.error >> t.seconds) || entry != wanted) {
+				continue;
+			}
+			t.solver = solver == "direct" ? ForceSolver::direct : ForceSolver::tree;
+			tuning = t;
+			found = true;
+		}
+		return found;
+	}
+
+	void save(const std::string& file, const std::string& entry, const Tuning& t) const {
+		std::ofstream file_out(file, std::ios::app);
+		if (!file_out) {
+			std::cerr << "ERROR::AUTOTUNE::CANNOT_WRITE " << file << std::endl;
+			return;
+		}
+		file_out << entry << " " << (t.solver == ForceSolver::direct ? "direct" : "tree") << " "
+			<< t.theta << " " << t.error << " " << t.seconds << "\n";
+	}
+
+	template<typename System>
+	Tuning load_or_tune(System& s, const std::string& file) {
+		std::string entry = key(s.amount, (int)sizeof(typename System::position_t::value_type) * 8);
+		Tuning t;
+		bool cached = load(file, entry, t);
+
+		if (!cached) {
+			t = tune(s);
+			save(file, entry, t);
+		}
+		if (out != nullptr) {
+			*out << "Solver: " << (t.solver == ForceSolver::direct ? "direct" : "tree") << " theta: " << t.theta
+				<< " force error: " << t.error << " pass: " << t.seconds * 1000.0 << " ms" << (cached ? " (cached)" : "") << std::endl;
+		}
+		return t;
+	}
+
+	template<typename System>
+	Tuning tune(System& s) {
+		int n = s.amount;
+		int samples = glm::min(sample_size, n);
+		std::vector<int> sample(samples);
+		for (int k = 0; k < samples; k++) {
+			sample[k] = (int)((long long)k * n / samples);
+		}
+
+		// exact forces on the sample
+		std::vector<glm::vec3> reference(samples);
+		s.direct.gravitational_constant = s.Qtree.gravitational_constant;
+		s.direct.softening = s.Qtree.softening;
+		s.direct.pack(s.particles);
+		s.direct.accelerations(samples, [&](int k) { return sample[k]; }, [&](int k, glm::vec3 a) { reference[k] = a; });
+
+		// the tree does not depend on theta, one build serves every candidate
+		const float thetas[] = { 1.f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f, 0.4f, 0.3f, 0.2f };
+		Tuning best;
+		s.build_tree();
+
+		for (float theta : thetas) {
+			s.Qtree.theta = theta;
+			double error = 0.0;
+
+			for (int k = 0; k < samples; k++) {
+				glm::vec3 a = s.Qtree.calc_forces_fast(s.particles[sample[k]].position, 1.f);
+				float exact = glm::length(reference[k]);
+				if (exact > 0.f) {
+					error += glm::length(a - reference[k]) / exact;
+				}
+			}
+			best.theta = theta;
+			best.error = samples > 0 ? error / samples : 0.0;
+			if (best.error <= target_error) {
+				break;
+			}
+		}
+
+		s.solver = ForceSolver::tree;
+		best.solver = ForceSolver::tree;
+		best.seconds = time_pass(s);
+
+		if (n <= max_direct) {
+			s.solver = ForceSolver::direct;
+			double seconds = time_pass(s);
+			if (seconds < best.seconds) {
+				best.solver = ForceSolver::direct;
+				best.seconds = seconds;
+				best.error = 0.0;
+			}
+		}
+		s.solver = best.solver;
+		return best;
+	}
+
+	// best of two full force passes, the particles do not move
+	template<typename System>
+	static double time_pass(System& s) {
+		double best = INFINITY;
+		for (int run = 0; run < 2; run++) {
+			auto start = std::chrono::steady_clock::now();
+			s.barnes_hut_multi();
+			best = glm::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		return best;
+	}
+};
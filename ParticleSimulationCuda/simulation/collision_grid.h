@@ -0,0 +1,205 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <cmath>
+#include <glm/glm.hpp>
+
+
+enum class Broadphase {
+	tree,	// neighbour queries on the gravity Quadtree, which is built every step anyway
+	grid,	// CollisionGrid, for when there is no fresh tree
+	list	// NeighbourList, cached pairs that are only rebuilt after the particles moved far enough
+};
+
+/* uniform grid broadphase for the collisions, the particles live in the z = 0 plane so the grid is 2d
+	the cells are at least 2 * max radius wide, so two touching particles are always in the same or in neighbouring cells
+
+	built with a parallel counting sort:
+		every thread counts its slice of the particles into its own histogram
+		a prefix sum over (cell, thread) gives every thread its own write range per cell
+		every thread scatters its slice, no atomics and the order inside a cell is the particle order
+	so the contacts come out in the same order on every run
+*/
+struct CollisionGrid {
+
+	int thread_count;
+	float cells_per_particle; //upper bound for the cell count, sparse systems get larger cells instead of empty memory
+	float margin; //pairs count as touching up to this gap between the discs, set by build
+
+	double cell_size;
+	glm::dvec2 origin;
+	int cells_x, cells_y;
+
+	std::vector<int> cell_of;		//cell of every particle
+	std::vector<int> cell_start;	//the particles of cell c are sorted[cell_start[c]] .. sorted[cell_start[c + 1] - 1]
+	std::vector<int> sorted;		//particle indices ordered by cell
+	std::vector<std::vector<int>> counts; //per thread histogram, then per thread write position
+
+	std::vector<std::vector<glm::ivec2>> thread_contacts;
+	std::vector<glm::ivec2> contacts; //overlapping pairs (i, j), i < j, in cell order
+
+	CollisionGrid(int threads = 4) :
+		thread_count(threads), cells_per_particle(1.f), margin(0.f), cell_size(1.0), origin(0.0), cells_x(1), cells_y(1),
+		counts(threads), thread_contacts(threads) {};
+
+	int cell_count() const {
+		return cells_x * cells_y;
+	}
+
+	template<typename P>
+	void build(const std::vector<P>& particles, float gap = 0.f) {
+		margin = gap;
+		int n = (int)particles.size();
+		int partition = (n + thread_count - 1) / thread_count;
+
+		// bounds and largest radius
+		std::vector<glm::dvec2> lo(thread_count, glm::dvec2(INFINITY));
+		std::vector<glm::dvec2> hi(thread_count, glm::dvec2(-INFINITY));
+		std::vector<float> max_r(thread_count, 0.f);
+
+		run([&](int t) {
+			int end = glm::min(n, (t + 1) * partition);
+			for (int i = t * partition; i < end; i++) {
+				glm::dvec2 p = glm::dvec2(particles[i].position);
+				lo[t] = glm::min(lo[t], p);
+				hi[t] = glm::max(hi[t], p);
+				max_r[t] = glm::max(max_r[t], particles[i].radius);
+			}
+		});
+
+		glm::dvec2 min_p(INFINITY), max_p(-INFINITY);
+		float max_radius = 0.f;
+		for (int t = 0; t < thread_count; t++) {
+			min_p = glm::min(min_p, lo[t]);
+			max_p = glm::max(max_p, hi[t]);
+			max_radius = glm::max(max_radius, max_r[t]);
+		}
+		if (n == 0) {
+			min_p = max_p = glm::dvec2(0.0);
+		}
+
+		glm::dvec2 extent = max_p - min_p;
+		double max_cells = glm::max(1.0, (double)cells_per_particle * n);
+		cell_size = glm::max(2.0 * max_radius + margin, std::sqrt(extent.x * extent.y / max_cells));
+		cell_size = glm::max(cell_size, glm::max(extent.x, extent.y) / max_cells);
+		if (cell_size <= 0.0) {
+			cell_size = 1.0;
+		}
+		origin = min_p;
+		cells_x = (int)(extent.x / cell_size) + 1;
+		cells_y = (int)(extent.y / cell_size) + 1;
+		int cells = cell_count();
+
+		// count
+		cell_of.resize(n);
+		run([&](int t) {
+			std::vector<int>& count = counts[t];
+			count.assign(cells, 0);
+
+			int end = glm::min(n, (t + 1) * partition);
+			for (int i = t * partition; i < end; i++) {
+				glm::dvec2 p = glm::dvec2(particles[i].position);
+				int cx = glm::min(cells_x - 1, (int)((p.x - origin.x) / cell_size));
+				int cy = glm::min(cells_y - 1, (int)((p.y - origin.y) / cell_size));
+				int c = cy * cells_x + cx;
+				cell_of[i] = c;
+				count[c]++;
+			}
+		});
+
+		// prefix sum, thread t writes behind threads 0 .. t - 1 inside every cell
+		cell_start.resize(cells + 1);
+		int offset = 0;
+		for (int c = 0; c < cells; c++) {
+			cell_start[c] = offset;
+			for (int t = 0; t < thread_count; t++) {
+				int k = counts[t][c];
+				counts[t][c] = offset;
+				offset += k;
+			}
+		}
+		cell_start[cells] = offset;
+
+		// scatter
+		sorted.resize(n);
+		run([&](int t) {
+			std::vector<int>& write = counts[t];
+			int end = glm::min(n, (t + 1) * partition);
+			for (int i = t * partition; i < end; i++) {
+				sorted[write[cell_of[i]]++] = i;
+			}
+		});
+	}
+
+	// narrowphase test for every pair in the same or a neighbouring cell, only overlapping pairs are kept
+	// (closer than margin, with a margin the result is a candidate list, see NeighbourList)
+	// each cell looks at itself and at 4 of its 8 neighbours, so every pair is tested once
+	template<typename P>
+	void find_contacts(const std::vector<P>& particles) {
+		const int offsets[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+		int rows = (cells_y + thread_count - 1) / thread_count;
+
+		run([&](int t) {
+			std::vector<glm::ivec2>& found = thread_contacts[t];
+			found.clear();
+
+			int y_end = glm::min(cells_y, (t + 1) * rows);
+			for (int cy = t * rows; cy < y_end; cy++) {
+				for (int cx = 0; cx < cells_x; cx++) {
+					int c = cy * cells_x + cx;
+
+					for (int a = cell_start[c]; a < cell_start[c + 1]; a++) {
+						int i = sorted[a];
+
+						for (int b = a + 1; b < cell_start[c + 1]; b++) {
+							test(particles, i, sorted[b], margin, found);
+						}
+
+						for (int k = 0; k < 4; k++) {
+							int nx = cx + offsets[k][0];
+							int ny = cy + offsets[k][1];
+							if (nx < 0 || nx >= cells_x || ny >= cells_y) {
+								continue;
+							}
+							int nc = ny * cells_x + nx;
+							for (int b = cell_start[nc]; b < cell_start[nc + 1]; b++) {
+								test(particles, i, sorted[b], margin, found);
+							}
+						}
+					}
+				}
+			}
+		});
+
+		contacts.clear();
+		for (const std::vector<glm::ivec2>& found : thread_contacts) {
+			contacts.insert(contacts.end(), found.begin(), found.end());
+		}
+	}
+
+	// tombstones (removed particles) never touch anything, with radius 0 a live disc could still overlap them
+	template<typename P>
+	static void test(const std::vector<P>& particles, int i, int j, float gap, std::vector<glm::ivec2>& found) {
+		if (!particles[i].alive || !particles[j].alive) {
+			return;
+		}
+		glm::vec3 d = glm::vec3(particles[j].position - particles[i].position);
+		float r = particles[i].radius + particles[j].radius + gap;
+		if (glm::dot(d, d) < r * r) {
+			found.push_back(i < j ? glm::ivec2(i, j) : glm::ivec2(j, i));
+		}
+	}
+
+	// runs f(t) on thread_count threads and waits for all of them
+	template<typename F>
+	void run(const F& f) {
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++) {
+			threads.emplace_back([&f, t]() { f(t); });
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+	}
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <glm/glm.hpp>
+
+
+/* splits the contacts into batches in which no particle appears twice, so a batch can be resolved in parallel
+	greedy colouring in list order: a pair gets the lowest colour neither of its particles has used yet
+	the colouring runs on one thread and only depends on the contact list,
+	so the result is bitwise the same for every thread count
+	after 64 colours a pair simply goes behind the last colour of both its particles
+*/
+struct ContactBatches {
+
+	int thread_count;
+	int min_parallel; //smaller batches are resolved on the calling thread, not worth starting threads
+
+	std::vector<unsigned long long> used;	//per particle, bit c = colour c is taken
+	std::vector<int> last_colour;			//per particle, last colour above 63, -1 = none
+	std::vector<int> colour;		//per contact
+	std::vector<int> batch_start;	//the contacts of batch b are order[batch_start[b]] .. order[batch_start[b + 1] - 1]
+	std::vector<int> order;			//contact indices sorted by batch, in list order inside a batch
+
+	ContactBatches(int threads = 4) : thread_count(threads), min_parallel(1024) {};
+
+	int batches() const {
+		return (int)batch_start.size() - 1;
+	}
+
+	void build(const std::vector<glm::ivec2>& contacts, int particle_count) {
+		if ((int)used.size() != particle_count) {
+			used.assign(particle_count, 0ull);
+			last_colour.assign(particle_count, -1);
+		}
+
+		int m = (int)contacts.size();
+		int colours = 0;
+		colour.resize(m);
+
+		for (int k = 0; k < m; k++) {
+			glm::ivec2 c = contacts[k];
+			unsigned long long taken = used[c.x] | used[c.y];
+			int col;
+
+			if (taken != ~0ull) {
+				col = 0;
+				while (taken & (1ull << col)) {
+					col++;
+				}
+				used[c.x] |= 1ull << col;
+				used[c.y] |= 1ull << col;
+			}
+			else {
+				col = glm::max(63, glm::max(last_colour[c.x], last_colour[c.y])) + 1;
+				last_colour[c.x] = col;
+				last_colour[c.y] = col;
+			}
+			colour[k] = col;
+			colours = glm::max(colours, col + 1);
+		}
+
+		// only the touched particles are reset, the arrays stay clear between steps
+		for (const glm::ivec2& c : contacts) {
+			used[c.x] = 0ull;
+			used[c.y] = 0ull;
+			last_colour[c.x] = -1;
+			last_colour[c.y] = -1;
+		}
+
+		// counting sort by colour
+		batch_start.assign(colours + 1, 0);
+		for (int k = 0; k < m; k++) {
+			batch_start[colour[k] + 1]++;
+		}
+		for (int b = 0; b < colours; b++) {
+			batch_start[b + 1] += batch_start[b];
+		}
+		order.resize(m);
+		std::vector<int> write(batch_start.begin(), batch_start.end() - 1);
+		for (int k = 0; k < m; k++) {
+			order[write[colour[k]]++] = k;
+		}
+	}
+
+	// calls fn(contact) for every contact, batch after batch, a batch is split across the threads
+	template<typename Fn>
+	void resolve(const std::vector<glm::ivec2>& contacts, const Fn& fn) {
+		for (int b = 0; b < batches(); b++) {
+			int begin = batch_start[b];
+			int end = batch_start[b + 1];
+
+			if (end - begin < min_parallel || thread_count < 2) {
+				for (int k = begin; k < end; k++) {
+					fn(contacts[order[k]]);
+				}
+				continue;
+			}
+
+			int partition = (end - begin + thread_count - 1) / thread_count;
+			std::vector<std::thread> threads;
+
+			for (int t = 0; t < thread_count; t++) {
+				threads.emplace_back([&, t]() {
+					int slice_end = glm::min(end, begin + (t + 1) * partition);
+					for (int k = begin + t * partition; k < slice_end; k++) {
+						fn(contacts[order[k]]);
+					}
+				});
+			}
+			for (std::thread& t : threads) {
+				t.join();
+			}
+		}
+	}
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <glm/glm.hpp>
+
+
+/* conservation monitoring: energy, linear and angular momentum, center of mass
+	the potential energy comes for free from the tree walk (Quadtree::calc_forces_potential),
+	everything else is one parallel reduction over the particles every `cadence` steps
+*/
+struct Diagnostics {
+
+	int cadence; //measure every n-th update, 0 = off
+	int thread_count;
+	std::ostream* out; //where measure() reports, nullptr = quiet
+
+	double total_mass;
+	glm::dvec3 center_mass;
+	glm::dvec3 center_mass_vel;
+	glm::dvec3 momentum;
+	glm::dvec3 angular_momentum; //around the center of mass
+
+	double kinetic;
+	double potential;
+	double energy;
+
+	double initial_energy;
+	bool has_initial;
+	int measurements;
+
+	Diagnostics(int c = 100, int threads = 4) :
+		cadence(c), thread_count(threads), out(&std::cout),
+		total_mass(0.0), center_mass(0.0), center_mass_vel(0.0), momentum(0.0), angular_momentum(0.0),
+		kinetic(0.0), potential(0.0), energy(0.0), initial_energy(0.0), has_initial(false), measurements(0) {};
+
+	bool due(long long step) const {
+		return cadence > 0 && step % cadence == 0;
+	}
+
+	// partial sums of one thread
+	struct Sums {
+		double mass = 0.0;
+		double kinetic = 0.0;
+		glm::dvec3 mass_position = glm::dvec3(0.0);
+		glm::dvec3 momentum = glm::dvec3(0.0);
+		glm::dvec3 angular_momentum = glm::dvec3(0.0); //around the origin
+	};
+
+	// mass, momentum, kinetic energy and angular momentum of all particles, split across threads
+	template<typename P>
+	void measure_kinematics(const std::vector<P>& particles) {
+		measure_kinematics(particles, [](const P& p, glm::dvec3& x, glm::dvec3& v) {
+			x = glm::dvec3(p.position);
+			v = glm::dvec3(p.velocity);
+		});
+	}
+
+	// state(p, x, v) gives the position and velocity to measure, schemes that keep the velocities
+	// and the positions at different times hand in the synchronised ones
+	template<typename P, typename State>
+	void measure_kinematics(const std::vector<P>& particles, const State& state) {
+
+		std::vector<Sums> sums(thread_count);
+		std::vector<std::thread> threads;
+		size_t n = particles.size();
+		size_t partition = (n + thread_count - 1) / thread_count;
+
+		for (int t = 0; t < thread_count; t++) {
+			threads.emplace_back([&, t]() {
+				Sums s;
+				size_t end = glm::min(n, (t + 1) * partition);
+
+				for (size_t i = t * partition; i < end; i++) {
+					const P& p = particles[i];
+					double m = p.mass;
+					glm::dvec3 x, v;
+					state(p, x, v);
+
+					s.mass += m;
+					s.kinetic += 0.5 * m * glm::dot(v, v);
+					s.mass_position += m * x;
+					s.momentum += m * v;
+					s.angular_momentum += m * glm::cross(x, v);
+				}
+				sums[t] = s;
+			});
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+
+		Sums total;
+		for (const Sums& s : sums) {
+			total.mass += s.mass;
+			total.kinetic += s.kinetic;
+			total.mass_position += s.mass_position;
+			total.momentum += s.momentum;
+			total.angular_momentum += s.angular_momentum;
+		}
+
+		total_mass = total.mass;
+		kinetic = total.kinetic;
+		momentum = total.momentum;
+		if (total_mass > 0.0) {
+			center_mass = total.mass_position / total_mass;
+			center_mass_vel = total.momentum / total_mass;
+		}
+		// parallel axis: L_com = L_origin - M * (R x V)
+		angular_momentum = total.angular_momentum - total_mass * glm::cross(center_mass, center_mass_vel);
+	}
+
+	// sum over m_i * phi_i, every pair is in there twice
+	void set_potential(double sum_mass_phi) {
+		potential = 0.5 * sum_mass_phi;
+	}
+
+	void finish() {
+		energy = kinetic + potential;
+		if (!has_initial) {
+			initial_energy = energy;
+			has_initial = true;
+		}
+		measurements++;
+
+		if (out != nullptr) {
+			*out << "Energy: " << energy << " Kinetic: " << kinetic << " Potential: " << potential
+				<< " dE/E0: " << relative_energy_error()
+				<< " |P|: " << glm::length(momentum) << " Lz: " << angular_momentum.z << std::endl;
+		}
+	}
+
+	double relative_energy_error() const {
+		return initial_energy != 0.0 ? (energy - initial_energy) / glm::abs(initial_energy) : 0.0;
+	}
+};
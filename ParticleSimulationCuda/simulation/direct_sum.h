@@ -0,0 +1,255 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <glm/glm.hpp>
+
+// sse is always there on x64, everything else takes the scalar loop
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DIRECT_SUM_SSE
+#include <emmintrin.h>
+#endif
+
+
+enum class ForceSolver {
+	tree,	// Barnes-Hut, O(n log n), approximate
+	direct	// DirectSum, O(n^2), exact, faster for small n
+};
+
+/* exact gravity by summing over all pairs, the same softened force as the Quadtree
+	a = G * m_j / (d^2 + eps^2) * d_v / d
+
+	pack() copies the positions into separate x, y, z, mass arrays (relative to the first particle, in float),
+	so the kernel streams them 4 at a time with an approximate rsqrt and one newton step
+	the j loop is blocked into tiles that stay in cache while a tile of i particles is summed against them,
+	the potential for the diagnostics is summed in the same tiles, in double, without a second pass over all particles
+	every i is only written by the thread that owns it, the order of the sum does not depend on the thread count
+*/
+struct DirectSum {
+	static const int tile_i = 64;
+	static const int tile_j = 1024;
+
+	float gravitational_constant;
+	float softening;
+
+	glm::dvec3 origin;
+	int count;
+	std::vector<float> x, y, z, mass; //padded to a multiple of 4 with massless particles
+
+	DirectSum() : gravitational_constant(0.00001f), softening(0.1f), origin(0.0), count(0) {};
+
+	template<typename P>
+	void pack(const std::vector<P>& particles) {
+		count = (int)particles.size();
+		int padded = (count + 3) & ~3;
+		origin = count > 0 ? glm::dvec3(particles[0].position) : glm::dvec3(0.0);
+
+		x.assign(padded, 0.f);
+		y.assign(padded, 0.f);
+		z.assign(padded, 0.f);
+		mass.assign(padded, 0.f);
+
+		for (int i = 0; i < count; i++) {
+			glm::vec3 p = glm::vec3(glm::dvec3(particles[i].position) - origin);
+			x[i] = p.x;
+			y[i] = p.y;
+			z[i] = p.z;
+			mass[i] = particles[i].mass;
+		}
+	}
+
+	// acceleration of the packed particles index(0) .. index(n - 1), out(k, a) receives the results
+	template<typename Index, typename Out>
+	void accelerations(int n, const Index& index, const Out& out) const {
+		sum(n, index, false, [&out](int k, glm::vec3 a, double) { out(k, a); });
+	}
+
+	// the same with the potential per unit mass, out(k, a, phi), phi is summed tile by tile next to the force
+	template<typename Index, typename Out>
+	void accelerations_potential(int n, const Index& index, const Out& out) const {
+		sum(n, index, true, out);
+	}
+
+	template<typename Index, typename Out>
+	void sum(int n, const Index& index, bool with_potential, const Out& out) const {
+		int padded = (int)x.size();
+
+		for (int k0 = 0; k0 < n; k0 += tile_i) {
+			int k1 = glm::min(n, k0 + tile_i);
+			glm::dvec3 acc[tile_i];
+			double phi[tile_i];
+			for (int k = 0; k < k1 - k0; k++) {
+				acc[k] = glm::dvec3(0.0);
+				phi[k] = 0.0;
+			}
+
+			for (int j0 = 0; j0 < padded; j0 += tile_j) {
+				int j1 = glm::min(padded, j0 + tile_j);
+
+				for (int k = k0; k < k1; k++) {
+					int i = index(k);
+					acc[k - k0] += glm::dvec3(sum_tile(x[i], y[i], z[i], j0, j1));
+					if (with_potential) {
+						phi[k - k0] += potential_tile(x[i], y[i], z[i], j0, j1);
+					}
+				}
+			}
+
+			for (int k = k0; k < k1; k++) {
+				out(k, glm::vec3(acc[k - k0]), phi[k - k0]);
+			}
+		}
+	}
+
+	// sum over j0 .. j1 - 1 for a body at (xi, yi, zi), j0 and j1 are multiples of 4
+	glm::vec3 sum_tile(float xi, float yi, float zi, int j0, int j1) const {
+		float eps_sq = softening * softening;
+
+#ifdef DIRECT_SUM_SSE
+		const __m128 bx = _mm_set1_ps(xi);
+		const __m128 by = _mm_set1_ps(yi);
+		const __m128 bz = _mm_set1_ps(zi);
+		const __m128 eps2 = _mm_set1_ps(eps_sq);
+		const __m128 g = _mm_set1_ps(gravitational_constant);
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 three_halves = _mm_set1_ps(1.5f);
+		const __m128 two = _mm_set1_ps(2.f);
+		const __m128 zero = _mm_setzero_ps();
+
+		__m128 ax = zero, ay = zero, az = zero;
+
+		for (int j = j0; j < j1; j += 4) {
+			__m128 dx = _mm_sub_ps(_mm_loadu_ps(&x[j]), bx);
+			__m128 dy = _mm_sub_ps(_mm_loadu_ps(&y[j]), by);
+			__m128 dz = _mm_sub_ps(_mm_loadu_ps(&z[j]), bz);
+			__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+			// 1 / d, rsqrt is good to 12 bits, one newton step brings it to about float precision
+			__m128 inv_d = _mm_rsqrt_ps(d2);
+			inv_d = _mm_mul_ps(inv_d, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, d2), _mm_mul_ps(inv_d, inv_d))));
+			// the body itself (and anything on top of it) has d = 0 and is dropped, like in the tree
+			inv_d = _mm_and_ps(inv_d, _mm_cmpgt_ps(d2, zero));
+
+			// 1 / (d^2 + eps^2), same trick with rcp
+			__m128 soft = _mm_add_ps(d2, eps2);
+			__m128 inv_soft = _mm_rcp_ps(soft);
+			inv_soft = _mm_mul_ps(inv_soft, _mm_sub_ps(two, _mm_mul_ps(soft, inv_soft)));
+
+			__m128 s = _mm_mul_ps(_mm_mul_ps(g, _mm_loadu_ps(&mass[j])), _mm_mul_ps(inv_d, inv_soft));
+			ax = _mm_add_ps(ax, _mm_mul_ps(s, dx));
+			ay = _mm_add_ps(ay, _mm_mul_ps(s, dy));
+			az = _mm_add_ps(az, _mm_mul_ps(s, dz));
+		}
+
+		float rx[4], ry[4], rz[4];
+		_mm_storeu_ps(rx, ax);
+		_mm_storeu_ps(ry, ay);
+		_mm_storeu_ps(rz, az);
+		return glm::vec3(rx[0] + rx[1] + rx[2] + rx[3], ry[0] + ry[1] + ry[2] + ry[3], rz[0] + rz[1] + rz[2] + rz[3]);
+#else
+		glm::vec3 a(0.f);
+		for (int j = j0; j < j1; j++) {
+			glm::vec3 d(x[j] - xi, y[j] - yi, z[j] - zi);
+			float d2 = glm::dot(d, d);
+			if (d2 > 0.f) {
+				a += (gravitational_constant * mass[j] / (sqrtf(d2) * (d2 + eps_sq))) * d;
+			}
+		}
+		return a;
+#endif
+	}
+
+	// potential per unit mass over j0 .. j1 - 1, same form as Quadtree::calc_potential, in double
+	// -G m / eps * (pi/2 - atan(d / eps)) is written as -G m / eps * atan(eps / d), the padding is massless and adds nothing
+	double potential_tile(float xi, float yi, float zi, int j0, int j1) const {
+		double g_soft = (double)gravitational_constant / softening;
+
+#ifdef DIRECT_SUM_SSE
+		// two lanes of double, the energy error the diagnostics report is far below float resolution
+		const __m128d bx = _mm_set1_pd(xi);
+		const __m128d by = _mm_set1_pd(yi);
+		const __m128d bz = _mm_set1_pd(zi);
+		const __m128d eps = _mm_set1_pd(softening);
+		const __m128d zero = _mm_setzero_pd();
+
+		__m128d phi = zero;
+
+		for (int j = j0; j < j1; j += 4) {
+			__m128 fx = _mm_loadu_ps(&x[j]);
+			__m128 fy = _mm_loadu_ps(&y[j]);
+			__m128 fz = _mm_loadu_ps(&z[j]);
+			__m128 fm = _mm_loadu_ps(&mass[j]);
+
+			for (int half = 0; half < 2; half++) {
+				__m128d dx = _mm_sub_pd(_mm_cvtps_pd(fx), bx);
+				__m128d dy = _mm_sub_pd(_mm_cvtps_pd(fy), by);
+				__m128d dz = _mm_sub_pd(_mm_cvtps_pd(fz), bz);
+				__m128d d2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+
+				// d = 0 is dropped like in the force
+				__m128d a = atan_ratio_pd(eps, _mm_sqrt_pd(d2));
+				a = _mm_and_pd(a, _mm_cmpgt_pd(d2, zero));
+				phi = _mm_sub_pd(phi, _mm_mul_pd(_mm_cvtps_pd(fm), a));
+
+				fx = _mm_movehl_ps(fx, fx);
+				fy = _mm_movehl_ps(fy, fy);
+				fz = _mm_movehl_ps(fz, fz);
+				fm = _mm_movehl_ps(fm, fm);
+			}
+		}
+
+		double r[2];
+		_mm_storeu_pd(r, phi);
+		return g_soft * (r[0] + r[1]);
+#else
+		double phi = 0.0;
+		for (int j = j0; j < j1; j++) {
+			glm::dvec3 d((double)x[j] - xi, (double)y[j] - yi, (double)z[j] - zi);
+			double distance = glm::length(d);
+			if (distance > 0.0) {
+				phi -= mass[j] * std::atan(softening / distance);
+			}
+		}
+		return g_soft * phi;
+#endif
+	}
+
+#ifdef DIRECT_SUM_SSE
+	// atan(y / x) of two pairs y, x >= 0 to full double precision, the reduction and the rational approximation of cephes
+	// y / x > tan(3 pi / 8): pi/2 + atan(-x / y), y / x > 0.66: pi/4 + atan((y - x) / (y + x)), the selects are masks
+	// taking y and x apart saves the division y / x, and x = 0 needs no special case
+	static __m128d atan_ratio_pd(__m128d y, __m128d x) {
+		const __m128d steep = _mm_cmpgt_pd(y, _mm_mul_pd(x, _mm_set1_pd(2.41421356237309504880)));
+		const __m128d middle = _mm_andnot_pd(steep, _mm_cmpgt_pd(y, _mm_mul_pd(x, _mm_set1_pd(0.66))));
+		const __m128d flat = _mm_andnot_pd(_mm_or_pd(steep, middle), _mm_castsi128_pd(_mm_set1_epi32(-1)));
+
+		__m128d numerator = _mm_or_pd(_mm_or_pd(
+			_mm_and_pd(steep, _mm_sub_pd(_mm_setzero_pd(), x)),
+			_mm_and_pd(middle, _mm_sub_pd(y, x))),
+			_mm_and_pd(flat, y));
+		__m128d denominator = _mm_or_pd(_mm_or_pd(
+			_mm_and_pd(steep, y),
+			_mm_and_pd(middle, _mm_add_pd(y, x))),
+			_mm_and_pd(flat, x));
+		__m128d reduced = _mm_div_pd(numerator, denominator);
+		__m128d offset = _mm_or_pd(
+			_mm_and_pd(steep, _mm_set1_pd(1.57079632679489661923 + 6.123233995736765886130e-17)),
+			_mm_and_pd(middle, _mm_set1_pd(0.78539816339744830962 + 0.5 * 6.123233995736765886130e-17)));
+
+		__m128d z = _mm_mul_pd(reduced, reduced);
+		__m128d p = _mm_set1_pd(-8.750608600031904122785e-1);
+		p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-1.615753718733365076637e1));
+		p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-7.500855792314704667340e1));
+		p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-1.228866684490136173410e2));
+		p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-6.485021904942025371773e1));
+		__m128d q = _mm_add_pd(z, _mm_set1_pd(2.485846490142306297962e1));
+		q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(1.650270098316988542046e2));
+		q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(4.328810604912902668951e2));
+		q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(4.853903996359136964868e2));
+		q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(1.945506571482613964425e2));
+
+		z = _mm_div_pd(_mm_mul_pd(z, p), q);
+		return _mm_add_pd(offset, _mm_add_pd(_mm_mul_pd(reduced, z), reduced));
+	}
+#endif
+};
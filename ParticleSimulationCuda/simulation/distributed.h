@@ -0,0 +1,487 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <glm/glm.hpp>
+
+#include "particlesystem.h"
+#include "transport.h"
+
+
+/* one rank of a simulation spread over several processes, every rank only holds the particles of its domain
+	domains: orthogonal recursive bisection of weighted position samples, the outer domains reach to infinity
+	so every position has an owner, recomputed every rebalance_every steps
+	every step: kick, drift, particles that left the domain migrate to their new owner, forces, kick (leapfrog kdk)
+
+	forces: every rank builds the tree of its own particles, then sends every other rank its locally essential tree,
+	the nodes that rank would accept as a whole for all of its particles (quad.size / distance < theta to the box
+	around them) as pseudo particles, the leaves as they are
+	the exchange runs on its own thread while the local tree is walked, the imported pseudo particles go into a
+	second tree that adds the forces of the other ranks, that second walk can open them further, so the result is
+	close to, not bitwise equal to, a single process run
+	collisions and block timesteps are not distributed, ids are the global particle indices
+*/
+template<typename Transport, typename Precision = SinglePrecision>
+struct DistributedT {
+	using System = ParticlesystemT<LeapfrogKDK, Precision>;
+	using particle_t = typename System::particle_t;
+	using position_t = typename System::position_t;
+
+	// what moves between the ranks
+	struct Migrant {
+		double position[3];
+		float velocity[3];
+		float mass;
+		float radius;
+		int32_t id;
+	};
+
+	struct PseudoParticle {
+		double x;
+		double y;
+		float mass;
+		float padding;
+	};
+
+	struct Sample {
+		double position[2];
+		double weight;
+	};
+
+	Transport& transport;
+	System local; //own particles and their tree
+	QuadtreeT<Precision> remote; //pseudo particles of the other ranks
+	std::vector<glm::dvec4> domains; //per rank: min x, min y, max x, max y, max exclusive
+	std::vector<glm::dvec4> bounds; //per rank: box around its particles after the last migration
+	long long total_count;
+
+	int rebalance_every;
+	int samples_per_rank;
+	bool started;
+	double time;
+	long long step_count;
+
+	// last step, for the progress output
+	int migrated; //particles this rank sent away
+	int imported; //pseudo particles this rank received
+	double comm_wait; //seconds the force pass waited for the exchange after the local walk was done
+
+	std::vector<std::vector<char>> out;
+	std::vector<std::vector<char>> in;
+
+	// every rank draws its share of the n particles of the initial conditions, the particles are the same as
+	// in a single process run with the same seed
+	DistributedT(Transport& t, int n, const InitialConditions& ic = InitialConditions()) :
+		transport(t), local(0, true, false, ic), total_count(n), rebalance_every(16), samples_per_rank(4096),
+		started(false), time(0.0), step_count(0), migrated(0), imported(0), comm_wait(0.0)
+	{
+		remote.gravitational_constant = local.Qtree.gravitational_constant;
+		remote.softening = local.Qtree.softening;
+
+		InitialConditions draw = ic;
+		draw.gravitational_constant = local.Qtree.gravitational_constant;
+		draw.softening = local.Qtree.softening;
+
+		int begin = (int)((long long)n * transport.rank / transport.size);
+		int end = (int)((long long)n * (transport.rank + 1) / transport.size);
+		local.particles.assign(end - begin, particle_t(ic.particle_radius, glm::vec3(0.f), glm::vec3(0.f)));
+		for (int i = begin; i < end; i++) {
+			glm::vec3 position, velocity;
+			draw.draw(i, n, position, velocity);
+			particle_t& p = local.particles[i - begin];
+			p.position = position_t(position);
+			p.velocity = velocity;
+			p.id = i;
+		}
+		local.amount = end - begin;
+		// the stable id index of the single process system is not kept, nothing is added or removed here
+		local.id_index.clear();
+		local.next_id = n;
+
+		domains.assign(transport.size, glm::dvec4(-INFINITY, -INFINITY, INFINITY, INFINITY));
+		rebalance();
+		migrate();
+	}
+
+	template<typename T>
+	static void append(std::vector<char>& bytes, const T& value) {
+		size_t at = bytes.size();
+		bytes.resize(at + sizeof(T));
+		std::memcpy(&bytes[at], &value, sizeof(T));
+	}
+
+	template<typename T>
+	static std::vector<T> unpack(const std::vector<char>& bytes) {
+		std::vector<T> values(bytes.size() / sizeof(T));
+		if (!values.empty()) {
+			std::memcpy(values.data(), bytes.data(), values.size() * sizeof(T));
+		}
+		return values;
+	}
+
+	// all to all: out[r] goes to rank r, in[r] comes from rank r, out[rank] is kept
+	// the sends run on their own thread, two ranks sending each other large messages can not block each other
+	bool exchange(std::vector<std::vector<char>>& send, std::vector<std::vector<char>>& receive) {
+		int size = transport.size;
+		int rank = transport.rank;
+		receive.resize(size);
+
+		// a failed send goes on with the other ranks, so they are not left waiting for this one
+		bool sent = true;
+		std::thread sender([&] {
+			for (int k = 1; k < size; k++) {
+				sent = transport.send((rank + k) % size, send[(rank + k) % size]) && sent;
+			}
+		});
+		bool ok = true;
+		for (int k = 1; k < size; k++) {
+			int from = (rank - k + size) % size;
+			ok = transport.receive(from, receive[from]) && ok;
+		}
+		sender.join();
+		receive[rank] = send[rank];
+		return ok && sent;
+	}
+
+	void clear_out() {
+		out.resize(transport.size);
+		for (std::vector<char>& bytes : out) {
+			bytes.clear();
+		}
+	}
+
+	// new domains: rank 0 bisects the samples of all ranks and sends the boxes back
+	bool rebalance() {
+		clear_out();
+		int n = local.amount;
+		int stride = glm::max(1, n / glm::max(1, samples_per_rank));
+		int taken = n > 0 ? (n + stride - 1) / stride : 0;
+		for (int i = 0; i < n; i += stride) {
+			Sample s;
+			s.position[0] = (double)local.particles[i].position.x;
+			s.position[1] = (double)local.particles[i].position.y;
+			s.weight = (double)n / taken;
+			append(out[0], s);
+		}
+		if (!exchange(out, in)) {
+			return false;
+		}
+
+		clear_out();
+		if (transport.rank == 0) {
+			std::vector<Sample> samples;
+			for (const std::vector<char>& bytes : in) {
+				std::vector<Sample> part = unpack<Sample>(bytes);
+				samples.insert(samples.end(), part.begin(), part.end());
+			}
+			bisect(samples, 0, samples.size(), 0, transport.size, glm::dvec4(-INFINITY, -INFINITY, INFINITY, INFINITY));
+			for (int r = 0; r < transport.size; r++) {
+				for (const glm::dvec4& d : domains) {
+					append(out[r], d);
+				}
+			}
+		}
+		if (!exchange(out, in)) {
+			return false;
+		}
+		domains = unpack<glm::dvec4>(in[0]);
+		return true;
+	}
+
+	// splits the samples begin .. end - 1 between the ranks first .. first + count - 1 along the longer side,
+	// every side gets a share of the weight that matches its number of ranks
+	void bisect(std::vector<Sample>& samples, size_t begin, size_t end, int first, int count, glm::dvec4 box) {
+		if (count == 1) {
+			domains[first] = box;
+			return;
+		}
+		glm::dvec2 lo(INFINITY), hi(-INFINITY);
+		double total = 0.0;
+		for (size_t i = begin; i < end; i++) {
+			lo = glm::min(lo, glm::dvec2(samples[i].position[0], samples[i].position[1]));
+			hi = glm::max(hi, glm::dvec2(samples[i].position[0], samples[i].position[1]));
+			total += samples[i].weight;
+		}
+		int axis = begin == end || hi.x - lo.x >= hi.y - lo.y ? 0 : 1;
+		std::sort(samples.begin() + begin, samples.begin() + end,
+			[axis](const Sample& a, const Sample& b) { return a.position[axis] < b.position[axis]; });
+
+		int left = count / 2;
+		double target = total * left / count;
+		double sum = 0.0;
+		size_t split = begin;
+		while (split < end && sum + samples[split].weight <= target) {
+			sum += samples[split].weight;
+			split++;
+		}
+
+		double cut;
+		if (begin == end) {
+			// nothing to go by, any cut inside the box
+			cut = glm::clamp(0.0, box[axis], box[axis + 2]);
+		}
+		else if (split == begin) {
+			cut = samples[begin].position[axis];
+		}
+		else if (split == end) {
+			cut = std::nextafter(samples[end - 1].position[axis], INFINITY);
+		}
+		else {
+			cut = 0.5 * (samples[split - 1].position[axis] + samples[split].position[axis]);
+		}
+
+		glm::dvec4 low = box, high = box;
+		low[axis + 2] = cut;
+		high[axis] = cut;
+		bisect(samples, begin, split, first, left, low);
+		bisect(samples, split, end, first + left, count - left, high);
+	}
+
+	int owner(const position_t& p) const {
+		double x = (double)p.x, y = (double)p.y;
+		for (int r = 0; r < (int)domains.size(); r++) {
+			const glm::dvec4& d = domains[r];
+			if (x >= d.x && y >= d.y && x < d.z && y < d.w) {
+				return r;
+			}
+		}
+		//nan
+		return transport.rank;
+	}
+
+	// particles that left the domain go to their owner, then every rank learns the boxes around the particles
+	bool migrate() {
+		clear_out();
+		int kept = 0;
+		for (int i = 0; i < local.amount; i++) {
+			particle_t& p = local.particles[i];
+			int r = owner(p.position);
+			if (r == transport.rank) {
+				local.particles[kept++] = p;
+				continue;
+			}
+			Migrant m;
+			m.position[0] = (double)p.position.x;
+			m.position[1] = (double)p.position.y;
+			m.position[2] = (double)p.position.z;
+			m.velocity[0] = p.velocity.x;
+			m.velocity[1] = p.velocity.y;
+			m.velocity[2] = p.velocity.z;
+			m.mass = p.mass;
+			m.radius = p.radius;
+			m.id = p.id;
+			append(out[r], m);
+		}
+		migrated = local.amount - kept;
+		local.particles.erase(local.particles.begin() + kept, local.particles.end());
+
+		if (!exchange(out, in)) {
+			return false;
+		}
+		for (int r = 0; r < transport.size; r++) {
+			if (r == transport.rank) {
+				continue;
+			}
+			for (const Migrant& m : unpack<Migrant>(in[r])) {
+				particle_t p(m.radius, glm::vec3(0.f), glm::vec3(m.velocity[0], m.velocity[1], m.velocity[2]));
+				p.position = position_t(glm::dvec3(m.position[0], m.position[1], m.position[2]));
+				p.mass = m.mass;
+				p.id = m.id;
+				local.particles.push_back(p);
+			}
+		}
+		local.amount = (int)local.particles.size();
+
+		glm::dvec4 box(INFINITY, INFINITY, -INFINITY, -INFINITY);
+		for (const particle_t& p : local.particles) {
+			box = glm::dvec4(glm::min((double)p.position.x, box.x), glm::min((double)p.position.y, box.y),
+				glm::max((double)p.position.x, box.z), glm::max((double)p.position.y, box.w));
+		}
+		clear_out();
+		for (int r = 0; r < transport.size; r++) {
+			append(out[r], box);
+		}
+		if (!exchange(out, in)) {
+			return false;
+		}
+		bounds.resize(transport.size);
+		for (int r = 0; r < transport.size; r++) {
+			bounds[r] = unpack<glm::dvec4>(in[r])[0];
+		}
+		return true;
+	}
+
+	// the part of the local tree another rank needs for all particles in box
+	void export_tree(const glm::dvec4& box, std::vector<char>& bytes) {
+		bytes.clear();
+		if (box.x > box.z || local.Qtree.nodes.empty() || local.Qtree.nodes[0].mass == 0) {
+			return;
+		}
+		export_node(0, box, bytes);
+	}
+
+	void export_node(int node, const glm::dvec4& box, std::vector<char>& bytes) {
+		const NodeT<Precision>& n = local.Qtree.nodes[node];
+		glm::dvec2 com = glm::dvec2(n.com());
+		glm::dvec2 d = glm::max(glm::max(glm::dvec2(box.x, box.y) - com, com - glm::dvec2(box.z, box.w)), glm::dvec2(0.0));
+		double distance = glm::length(d);
+
+		if (n.is_leaf || n.quad.size < local.Qtree.theta * distance) {
+			PseudoParticle p;
+			p.x = com.x;
+			p.y = com.y;
+			p.mass = n.mass;
+			p.padding = 0.f;
+			append(bytes, p);
+			return;
+		}
+		for (int i = 0; i < 4; i++) {
+			if (local.Qtree.nodes[n.children + i].mass != 0) {
+				export_node(n.children + i, box, bytes);
+			}
+		}
+	}
+
+	// new acceleration of every local particle, the exchange of the essential trees overlaps the local walk
+	bool forces() {
+		local.solver = ForceSolver::tree;
+		local.prepare_forces();
+
+		clear_out();
+		for (int r = 0; r < transport.size; r++) {
+			if (r != transport.rank) {
+				export_tree(bounds[r], out[r]);
+			}
+		}
+		bool ok = true;
+		std::thread comm([&] { ok = exchange(out, in); });
+
+		// the walk starts below the root, it needs at least one split
+		if (local.amount > 1) {
+			local.force_pass();
+		}
+		else {
+			for (particle_t& p : local.particles) {
+				p.new_acceleration = glm::vec3(0.f);
+			}
+		}
+		auto waiting = std::chrono::high_resolution_clock::now();
+		comm.join();
+		comm_wait = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - waiting).count();
+		if (!ok) {
+			return false;
+		}
+
+		std::vector<PseudoParticle> imports;
+		for (int r = 0; r < transport.size; r++) {
+			if (r != transport.rank) {
+				std::vector<PseudoParticle> part = unpack<PseudoParticle>(in[r]);
+				imports.insert(imports.end(), part.begin(), part.end());
+			}
+		}
+		imported = (int)imports.size();
+		add_remote_forces(imports);
+
+		for (particle_t& p : local.particles) {
+			p.acceleration = p.new_acceleration;
+		}
+		return true;
+	}
+
+	void add_remote_forces(const std::vector<PseudoParticle>& imports) {
+		if (imports.empty()) {
+			return;
+		}
+		glm::dvec2 lo(INFINITY), hi(-INFINITY);
+		for (const PseudoParticle& p : imports) {
+			lo = glm::min(lo, glm::dvec2(p.x, p.y));
+			hi = glm::max(hi, glm::dvec2(p.x, p.y));
+		}
+		float size = (float)glm::max(hi.x - lo.x, hi.y - lo.y) * 1.001f + 1e-3f;
+		remote.theta = local.Qtree.theta;
+		remote.reset(glm::vec3(glm::vec2(0.5 * (lo + hi)), 0.f), size, imports.size());
+		for (const PseudoParticle& p : imports) {
+			position_t position = position_t(glm::dvec3(p.x, p.y, 0.0));
+			remote.insert(position, p.mass);
+		}
+
+		int partition = (local.amount + 3) / 4;
+		std::vector<std::thread> workers;
+		for (int t = 0; t < 4; t++) {
+			workers.emplace_back([&, t]() {
+				int end = glm::min(local.amount, (t + 1) * partition);
+				for (int i = t * partition; i < end; i++) {
+					particle_t& p = local.particles[i];
+					if (imports.size() == 1) {
+						// a single import is the root leaf, the walk only looks at children
+						glm::vec3 d = glm::vec3(glm::dvec3(imports[0].x, imports[0].y, 0.0) - glm::dvec3(p.position));
+						float distance = glm::length(d);
+						if (distance > 0.f) {
+							p.new_acceleration += remote.calc_acceleration(1.f, imports[0].mass, distance, d);
+						}
+					}
+					else {
+						p.new_acceleration += remote.calc_forces_fast(p.position, 1.f);
+					}
+				}
+			});
+		}
+		for (std::thread& w : workers) {
+			w.join();
+		}
+	}
+
+	// one leapfrog kdk step of dt = local.dt on all ranks, false if a rank went away
+	bool step() {
+		if (!started) {
+			if (!forces()) {
+				return false;
+			}
+			started = true;
+		}
+		float dt = local.dt;
+		for (particle_t& p : local.particles) {
+			p.velocity += p.acceleration * (0.5f * dt);
+			p.position += position_t(p.velocity * dt);
+		}
+
+		step_count++;
+		if (step_count % rebalance_every == 0 && !rebalance()) {
+			return false;
+		}
+		if (!migrate() || !forces()) {
+			return false;
+		}
+
+		for (particle_t& p : local.particles) {
+			p.velocity += p.acceleration * (0.5f * dt);
+		}
+		local.step_count = step_count;
+		time += dt;
+		local.time = time;
+		return true;
+	}
+
+	// particles on all ranks together, every rank gets the sum
+	long long global_count() {
+		clear_out();
+		for (int r = 0; r < transport.size; r++) {
+			append(out[r], (long long)local.amount);
+		}
+		long long sum = 0;
+		if (exchange(out, in)) {
+			for (int r = 0; r < transport.size; r++) {
+				sum += unpack<long long>(in[r])[0];
+			}
+		}
+		return sum;
+	}
+};
+
+using Distributed = DistributedT<SocketTransport>;
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+
+/* Philox 4x32-10, counter based random numbers (Salmon et al. 2011)
+	the numbers are a pure function of (counter, key), every particle draws from its own counter
+	so the result does not depend on how the particles are split across threads, or on the order
+*/
+struct Philox {
+
+	static glm::uvec4 generate(uint64_t counter_lo, uint64_t counter_hi, uint64_t key) {
+		uint32_t c0 = (uint32_t)counter_lo, c1 = (uint32_t)(counter_lo >> 32);
+		uint32_t c2 = (uint32_t)counter_hi, c3 = (uint32_t)(counter_hi >> 32);
+		uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+
+		for (int round = 0; round < 10; round++) {
+			uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+			uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+
+			uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			c1 = (uint32_t)p1;
+			c3 = (uint32_t)p0;
+			c0 = n0;
+			c2 = n2;
+
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		return glm::uvec4(c0, c1, c2, c3);
+	}
+
+	// 24 random bits to a float in (0, 1), never exactly 0 or 1, so logs are safe
+	static float uniform(uint32_t bits) {
+		return ((bits >> 8) + 0.5f) * (1.f / 16777216.f);
+	}
+
+	static glm::vec4 uniform4(uint64_t index, uint64_t stream, uint64_t key) {
+		glm::uvec4 r = generate(index, stream, key);
+		return glm::vec4(uniform(r.x), uniform(r.y), uniform(r.z), uniform(r.w));
+	}
+};
+
+enum class ICPreset {
+	uniform,			// square of side 2 * scale, at rest, what spawn() always did
+	plummer,			// projected Plummer profile with core radius scale, on circular orbits
+	exponential_disk,	// surface density exp(-R / scale), on circular orbits plus dispersion
+	colliding_galaxies	// two exponential disks on a collision course
+};
+
+/* reproducible initial conditions, generated in parallel
+	everything lives in the z = 0 plane like the rest of the simulation, the disks rotate counter clockwise
+	circular velocities come from the enclosed mass and the softened force of the tree: v^2 = G M(<R) R / (R^2 + eps^2)
+	gravitational_constant and softening are filled in by the particle system
+*/
+struct InitialConditions {
+
+	ICPreset preset;
+	uint64_t seed;
+	float scale;
+	float particle_radius;
+	float dispersion;		//random velocity, as a fraction of the circular velocity
+	float separation;		//colliding galaxies: distance between the centers along x
+	float impact;			//colliding galaxies: offset along y
+	float approach_speed;	//colliding galaxies: speed of each galaxy towards the other
+	int threads;			//0 = all cores
+
+	float gravitational_constant;
+	float softening;
+
+	InitialConditions(ICPreset p = ICPreset::uniform, uint64_t s = 1) :
+		preset(p), seed(s), scale(10.f), particle_radius(0.01f), dispersion(0.05f),
+		separation(40.f), impact(10.f), approach_speed(0.01f), threads(0),
+		gravitational_constant(0.00001f), softening(0.1f) {};
+
+	template<typename P>
+	void generate(std::vector<P>& particles, int n) const {
+		particles.assign(n, P(particle_radius, glm::vec3(0.f), glm::vec3(0.f)));
+
+		int thread_count = threads > 0 ? threads : (int)glm::max(1u, std::thread::hardware_concurrency());
+		int partition = (n + thread_count - 1) / thread_count;
+		std::vector<std::thread> workers;
+
+		for (int t = 0; t < thread_count; t++) {
+			workers.emplace_back([&, t]() {
+				int end = glm::min(n, (t + 1) * partition);
+				for (int i = t * partition; i < end; i++) {
+					glm::vec3 position, velocity;
+					draw(i, n, position, velocity);
+					particles[i].position = typename P::position_t(position);
+					particles[i].velocity = velocity;
+				}
+			});
+		}
+		for (std::thread& w : workers) {
+			w.join();
+		}
+	}
+
+	// position and velocity of particle i out of n, only depends on i, n and the settings
+	void draw(int i, int n, glm::vec3& position, glm::vec3& velocity) const {
+		glm::vec4 u = Philox::uniform4((uint64_t)i, (uint64_t)preset, seed);
+
+		switch (preset) {
+		case ICPreset::uniform:
+			position = glm::vec3((2.f * u.x - 1.f) * scale, (2.f * u.y - 1.f) * scale, 0.f);
+			velocity = glm::vec3(0.f);
+			return;
+
+		case ICPreset::plummer:
+			disk(i, u, (float)n, false, position, velocity);
+			return;
+
+		case ICPreset::exponential_disk:
+			disk(i, u, (float)n, true, position, velocity);
+			return;
+
+		case ICPreset::colliding_galaxies: {
+			// first half is the galaxy on the left, second half the one on the right
+			int half = n / 2;
+			bool left = i < half;
+			float galaxy_mass = (float)(left ? half : n - half);
+			disk(i, u, galaxy_mass, true, position, velocity);
+
+			float side = left ? -1.f : 1.f;
+			position += glm::vec3(side * 0.5f * separation, side * 0.5f * impact, 0.f);
+			velocity += glm::vec3(-side * approach_speed, 0.f, 0.f);
+			return;
+		}
+		}
+	}
+
+	// one rotating disk around the origin with the given total mass (every particle has mass 1)
+	void disk(int i, glm::vec4 u, float total_mass, bool exponential, glm::vec3& position, glm::vec3& velocity) const {
+		const float two_pi = 6.28318530718f;
+		float radius, enclosed;
+
+		if (exponential) {
+			// R * exp(-R / scale) is a gamma(2) distribution, the sum of two exponential draws
+			radius = -scale * logf(u.x * u.y);
+			float x = radius / scale;
+			enclosed = 1.f - (1.f + x) * expf(-x);
+		}
+		else {
+			// projected Plummer: M(<R) / M = R^2 / (R^2 + a^2), cut at 99% of the mass
+			const float cut = 0.99f;
+			float m = u.x * cut;
+			radius = scale * sqrtf(m / (1.f - m));
+			enclosed = m / cut;
+		}
+
+		float angle = two_pi * u.z;
+		float c = cosf(angle), s = sinf(angle);
+		position = glm::vec3(radius * c, radius * s, 0.f);
+
+		float v_circ = sqrtf(gravitational_constant * enclosed * total_mass * radius / (radius * radius + softening * softening));
+		velocity = v_circ * glm::vec3(-s, c, 0.f);
+
+		// gaussian dispersion from a second draw of the same particle, box muller
+		glm::vec4 g = Philox::uniform4((uint64_t)i, (uint64_t)preset + 16, seed);
+		float amplitude = dispersion * v_circ * sqrtf(-2.f * logf(g.x));
+		velocity += amplitude * glm::vec3(cosf(two_pi * g.y), sinf(two_pi * g.y), 0.f);
+	}
+};
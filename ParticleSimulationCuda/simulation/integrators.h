@@ -0,0 +1,193 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "particle.h"
+
+
+/* integrator policies for ParticlesystemT, picked at compile time
+	every policy has a static step(system, dt), the system provides
+		particles				the particle array the loops run over
+		dt_prev					the dt of the last step, the adaptive mode changes dt from step to step
+		barnes_hut_multi()		new_acceleration of every particle at the current positions
+		fused_pass(finish)		the same, but finish(p) integrates each particle right after its force
+
+	the energy needs positions, velocities and the potential at the same time, every policy says where:
+		measure_before_step		the state before step() is synchronised and the first force pass sees it
+		potential_in_step		otherwise: the first force pass of step() sees the synchronised positions,
+								false = the system evaluates the potential there in an extra pass
+		synchronize(p, dt, x, v)	after step(): position and velocity of p at that synchronised time
+
+	the steady state of every scheme is a single fused pass per force evaluation,
+	the kick / drift loops below are only needed for the first half step
+*/
+
+template<typename P>
+inline void drift(std::vector<P>& particles, float h) {
+	for (P& p : particles) {
+		p.position += typename P::position_t(p.velocity * h);
+	}
+}
+
+template<typename P>
+inline void kick(std::vector<P>& particles, float h) {
+	for (P& p : particles) {
+		p.velocity += p.acceleration * h;
+	}
+}
+
+// moves the freshly calculated accelerations into place
+template<typename P>
+inline void accept_forces(std::vector<P>& particles) {
+	for (P& p : particles) {
+		p.acceleration = p.new_acceleration;
+		p.new_acceleration = glm::vec3(0.f);
+	}
+}
+
+// kick with the new force, then drift, for a single particle inside a fused pass
+template<typename P>
+inline void kick_drift(P& p, float kick_h, float drift_h) {
+	p.acceleration = p.new_acceleration;
+	p.new_acceleration = glm::vec3(0.f);
+	p.velocity += p.acceleration * kick_h;
+	p.position += typename P::position_t(p.velocity * drift_h);
+}
+
+// the original scheme: forces at the current positions, then Particle::forces_verlet
+// which uses the accelerations of the last two force passes
+struct VelocityVerlet {
+	static const char* name() { return "velocity verlet"; }
+
+	static const bool measure_before_step = true;
+	static const bool potential_in_step = true;
+
+	template<typename P>
+	static void synchronize(const P& p, float dt, glm::dvec3& x, glm::dvec3& v) {
+		x = glm::dvec3(p.position);
+		v = glm::dvec3(p.velocity);
+	}
+
+	template<typename System>
+	static void step(System& s, float dt) {
+		s.fused_pass([dt](auto& p) {
+			p.dt = dt;
+			p.forces_verlet();
+		});
+	}
+};
+
+/* kick drift kick leapfrog, one force pass per step
+	the closing kick of step n and the opening kick of step n + 1 use the same force, so they merge:
+	K(dt/2) D(dt) | K(dt/2) K(dt/2) D(dt) | ...  ->  K(dt/2) D(dt) | K(dt) D(dt) | ...
+	with a changing dt the merged kick is K((dt_prev + dt) / 2)
+	the stored velocities are half a step ahead of the positions
+*/
+struct LeapfrogKDK {
+	static const char* name() { return "leapfrog KDK"; }
+
+	static const bool measure_before_step = false;
+	static const bool potential_in_step = true;
+
+	// the force pass saw x - v * dt, the velocity there is the stored one minus the opening half kick
+	template<typename P>
+	static void synchronize(const P& p, float dt, glm::dvec3& x, glm::dvec3& v) {
+		x = glm::dvec3(p.position) - glm::dvec3(p.velocity) * (double)dt;
+		v = glm::dvec3(p.velocity - p.acceleration * (0.5f * dt));
+	}
+
+	template<typename System>
+	static void step(System& s, float dt) {
+		if (!s.integrator_started) {
+			s.barnes_hut_multi();
+			accept_forces(s.particles);
+			kick(s.particles, dt * 0.5f);
+			drift(s.particles, dt);
+			s.integrator_started = true;
+			s.dt_prev = dt;
+			return;
+		}
+
+		float kick_h = 0.5f * (s.dt_prev + dt);
+		s.fused_pass([kick_h, dt](auto& p) { kick_drift(p, kick_h, dt); });
+		s.dt_prev = dt;
+	}
+};
+
+/* drift kick drift leapfrog, one force pass per step at the half step positions
+	D(dt/2) K(dt) D(dt/2) | D(dt/2) K(dt) D(dt/2)  ->  D(dt/2) | K(dt) D(dt) | K(dt) D(dt) ...
+	the stored positions are half a step ahead of the velocities
+	the merged drift already used the old dt for the opening half, a new dt first moves the positions
+	by the difference, so the force is still taken in the middle of the step
+*/
+struct LeapfrogDKD {
+	static const char* name() { return "leapfrog DKD"; }
+
+	static const bool measure_before_step = false;
+	static const bool potential_in_step = true;
+
+	// the force pass saw the middle of the step, the velocity there is half a kick before the stored one
+	template<typename P>
+	static void synchronize(const P& p, float dt, glm::dvec3& x, glm::dvec3& v) {
+		LeapfrogKDK::synchronize(p, dt, x, v);
+	}
+
+	template<typename System>
+	static void step(System& s, float dt) {
+		if (!s.integrator_started) {
+			drift(s.particles, dt * 0.5f);
+			s.integrator_started = true;
+		}
+		else if (dt != s.dt_prev) {
+			drift(s.particles, 0.5f * (dt - s.dt_prev));
+		}
+
+		s.fused_pass([dt](auto& p) { kick_drift(p, dt, dt); });
+		s.dt_prev = dt;
+	}
+};
+
+/* Forest-Ruth / Yoshida 4th order, three leapfrog steps with the weights w1, w0, w1
+	three force passes per step, but the energy error falls with dt^4 instead of dt^2
+	D(c1) K(d1) D(c2) K(d2) D(c3) K(d3) D(c4), the last drift merges with the first of the next step
+	that merged drift assumes the next dt is the same, a new dt corrects it by c1 * (dt - dt_prev) first
+*/
+struct Yoshida4 {
+	static const char* name() { return "Yoshida 4th order"; }
+
+	static const bool measure_before_step = false;
+	static const bool potential_in_step = false;
+
+	// the end of the step is the only synchronised point, the positions are c1 * dt past it
+	template<typename P>
+	static void synchronize(const P& p, float dt, glm::dvec3& x, glm::dvec3& v) {
+		const double w1 = 1.0 / (2.0 - std::cbrt(2.0));
+		v = glm::dvec3(p.velocity);
+		x = glm::dvec3(p.position) - v * (0.5 * w1 * dt);
+	}
+
+	template<typename System>
+	static void step(System& s, float dt) {
+		const double cbrt2 = std::cbrt(2.0);
+		const float w1 = (float)(1.0 / (2.0 - cbrt2));
+		const float w0 = (float)(-cbrt2 / (2.0 - cbrt2));
+
+		const float c[4] = { w1 * 0.5f, (w0 + w1) * 0.5f, (w0 + w1) * 0.5f, w1 * 0.5f };
+		const float d[3] = { w1, w0, w1 };
+
+		if (!s.integrator_started) {
+			drift(s.particles, c[0] * dt);
+			s.integrator_started = true;
+		}
+		else if (dt != s.dt_prev) {
+			drift(s.particles, c[0] * (dt - s.dt_prev));
+		}
+
+		s.fused_pass([&](auto& p) { kick_drift(p, d[0] * dt, c[1] * dt); });
+		s.fused_pass([&](auto& p) { kick_drift(p, d[1] * dt, c[2] * dt); });
+		s.fused_pass([&](auto& p) { kick_drift(p, d[2] * dt, (c[3] + c[0]) * dt); });
+		s.dt_prev = dt;
+	}
+};
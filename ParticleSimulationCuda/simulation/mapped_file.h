@@ -0,0 +1,180 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdio>
+#endif
+
+
+// a whole file mapped into memory, MapViewOfFile on windows, mmap everywhere else
+// the pages are only read from disk when they are touched
+struct MappedFile {
+
+	void* data;
+	size_t size;
+	bool writable;
+
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+
+	MappedFile() : data(nullptr), size(0), writable(false) {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#else
+		fd = -1;
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// creates (or truncates) the file with exactly bytes bytes and maps it for writing
+	bool create(const std::string& path, size_t bytes) {
+		close();
+		writable = true;
+		size = bytes;
+
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32), (DWORD)(bytes & 0xffffffffull), NULL);
+		if (mapping == NULL) {
+			close();
+			return false;
+		}
+		data = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, bytes);
+#else
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) {
+			close();
+			return false;
+		}
+		data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// maps an existing file read only
+	bool open_read(const std::string& path) {
+		close();
+		writable = false;
+
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+			close();
+			return false;
+		}
+		size = (size_t)file_size.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			close();
+			return false;
+		}
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+			close();
+			return false;
+		}
+		size = (size_t)st.st_size;
+		data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// pushes the written pages and the file itself to disk, only returns once they are there
+	bool flush() {
+		if (data == nullptr || !writable) {
+			return false;
+		}
+#ifdef _WIN32
+		return FlushViewOfFile(data, 0) && FlushFileBuffers(file);
+#else
+		return msync(data, size, MS_SYNC) == 0 && fsync(fd) == 0;
+#endif
+	}
+
+	// puts from in the place of to in one step, to is either the old or the new file, never missing
+	static bool replace(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return ::rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data != nullptr) {
+			if (writable) {
+				FlushViewOfFile(data, 0);
+			}
+			UnmapViewOfFile(data);
+		}
+		if (mapping != NULL) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <glm/glm.hpp>
+
+#include "collision_grid.h"
+
+
+/* verlet neighbour list for the short range interactions, kept over many steps
+	every pair closer than r_i + r_j + skin goes into the list when it is built,
+	as long as no particle moved more than skin / 2 since then, no pair outside the list can touch
+	compressed rows: the partners of i are neighbours[offsets[i]] .. neighbours[offsets[i + 1] - 1], only j > i
+	so a short range pass is one streaming read over two int arrays
+*/
+struct NeighbourList {
+
+	float skin;
+	int thread_count;
+
+	std::vector<int> offsets;
+	std::vector<int> neighbours;
+	std::vector<glm::dvec3> built_at; //positions at the last build
+
+	long long builds;
+	long long reuses;
+
+	std::vector<std::vector<glm::ivec2>> thread_contacts;
+	std::vector<glm::ivec2> contacts; //overlapping pairs of the last find_contacts, i < j
+
+	NeighbourList(float s = 0.02f, int threads = 4) :
+		skin(s), thread_count(threads), builds(0), reuses(0), thread_contacts(threads) {};
+
+	int pair_count() const {
+		return (int)neighbours.size();
+	}
+
+	// forces a rebuild on the next update, after particles were added, removed or moved in memory
+	void invalidate() {
+		built_at.clear();
+	}
+
+	// true if some particle moved more than skin / 2 since the last build, or the particles changed
+	template<typename P>
+	bool needs_rebuild(const std::vector<P>& particles) const {
+		if (built_at.size() != particles.size()) {
+			return true;
+		}
+		double limit_sq = 0.25 * (double)skin * skin;
+
+		for (size_t i = 0; i < particles.size(); i++) {
+			glm::dvec3 d = glm::dvec3(particles[i].position) - built_at[i];
+			if (glm::dot(d, d) > limit_sq) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// candidate pairs from the grid with the skin as margin, then sorted into rows
+	template<typename P>
+	void build(const std::vector<P>& particles, CollisionGrid& grid) {
+		int n = (int)particles.size();
+
+		grid.build(particles, skin);
+		grid.find_contacts(particles);
+
+		offsets.assign(n + 1, 0);
+		for (const glm::ivec2& c : grid.contacts) {
+			offsets[c.x + 1]++;
+		}
+		for (int i = 0; i < n; i++) {
+			offsets[i + 1] += offsets[i];
+		}
+		neighbours.resize(grid.contacts.size());
+		std::vector<int> write(offsets.begin(), offsets.end() - 1);
+		for (const glm::ivec2& c : grid.contacts) {
+			neighbours[write[c.x]++] = c.y;
+		}
+
+		built_at.resize(n);
+		for (int i = 0; i < n; i++) {
+			built_at[i] = glm::dvec3(particles[i].position);
+		}
+		builds++;
+	}
+
+	template<typename P>
+	void update(const std::vector<P>& particles, CollisionGrid& grid) {
+		if (needs_rebuild(particles)) {
+			build(particles, grid);
+		}
+		else {
+			reuses++;
+		}
+	}
+
+	// calls fn(i, j) for every listed pair of the particles begin .. end - 1
+	template<typename Fn>
+	void for_each_pair(int begin, int end, const Fn& fn) const {
+		for (int i = begin; i < end; i++) {
+			for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+				fn(i, neighbours[k]);
+			}
+		}
+	}
+
+	// the listed pairs whose discs overlap right now, rows split across threads, in row order
+	template<typename P>
+	void find_contacts(const std::vector<P>& particles) {
+		int n = (int)offsets.size() - 1;
+		int partition = (n + thread_count - 1) / thread_count;
+		std::vector<std::thread> threads;
+
+		for (int t = 0; t < thread_count; t++) {
+			threads.emplace_back([&, t]() {
+				std::vector<glm::ivec2>& found = thread_contacts[t];
+				found.clear();
+
+				for_each_pair(glm::min(n, t * partition), glm::min(n, (t + 1) * partition), [&](int i, int j) {
+					// a pair listed before one of the two was removed
+					if (!particles[i].alive || !particles[j].alive) {
+						return;
+					}
+					glm::vec3 d = glm::vec3(particles[j].position - particles[i].position);
+					float r = particles[i].radius + particles[j].radius;
+					if (glm::dot(d, d) < r * r) {
+						found.push_back(glm::ivec2(i, j));
+					}
+				});
+			});
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+
+		contacts.clear();
+		for (const std::vector<glm::ivec2>& found : thread_contacts) {
+			contacts.insert(contacts.end(), found.begin(), found.end());
+		}
+	}
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+
+/* storage of the Quadtree nodes, used like the std::vector they lived in before
+	one block, reserved for the predicted size of the tree and kept across steps, clear() is O(1)
+	blocks of 2 MB and more are 2 MB aligned and advised for transparent huge pages (linux), the tree walk
+	jumps all over the block, with 4 KB pages nearly every node it touches would be a tlb miss
+	windows only hands out large pages with the lock memory privilege, there the block is just cache line aligned
+	a tree that outgrows its block still works, the block is doubled and grown counts how often that happened
+*/
+template<typename T>
+struct NodeArena {
+	static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value, "nodes are copied as bytes");
+
+	static const size_t huge_page = (size_t)2 << 20;
+
+	T* data;
+	size_t count;
+	size_t reserved;
+	size_t bytes; //of the block, rounded up to the alignment
+	int grown; //reallocations while a tree was built, the prediction was too small
+	bool huge_pages; //the block is advised for huge pages
+
+	NodeArena() : data(nullptr), count(0), reserved(0), bytes(0), grown(0), huge_pages(false) {};
+
+	~NodeArena() {
+		release();
+	}
+
+	NodeArena(const NodeArena& other) : NodeArena() {
+		*this = other;
+	}
+
+	NodeArena& operator=(const NodeArena& other) {
+		if (this != &other) {
+			clear();
+			reserve(other.count);
+			if (other.count > 0) {
+				std::memcpy(data, other.data, other.count * sizeof(T));
+			}
+			count = other.count;
+		}
+		return *this;
+	}
+
+	size_t size() const { return count; }
+	size_t capacity() const { return reserved; }
+	bool empty() const { return count == 0; }
+
+	T& operator[](size_t i) { return data[i]; }
+	const T& operator[](size_t i) const { return data[i]; }
+
+	T* begin() { return data; }
+	T* end() { return data + count; }
+	const T* begin() const { return data; }
+	const T* end() const { return data + count; }
+
+	// the nodes are plain data, forgetting them is all a reset needs
+	void clear() {
+		count = 0;
+	}
+
+	void push_back(const T& node) {
+		if (count == reserved) {
+			grown += reserved > 0 ? 1 : 0;
+			reserve(reserved > 0 ? 2 * reserved : 64);
+		}
+		new (data + count) T(node);
+		count++;
+	}
+
+	// never shrinks, the nodes that are there are kept
+	void reserve(size_t n) {
+		if (n <= reserved) {
+			return;
+		}
+		size_t alignment = n * sizeof(T) >= huge_page ? huge_page : 64;
+		size_t new_bytes = (n * sizeof(T) + alignment - 1) / alignment * alignment;
+		T* block = (T*)allocate(new_bytes, alignment);
+		if (block == nullptr) {
+			throw std::bad_alloc();
+		}
+		bool advised = false;
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+		advised = alignment == huge_page && madvise(block, new_bytes, MADV_HUGEPAGE) == 0;
+#endif
+		if (count > 0) {
+			std::memcpy(block, data, count * sizeof(T));
+		}
+		release_block();
+		data = block;
+		bytes = new_bytes;
+		reserved = new_bytes / sizeof(T);
+		huge_pages = advised;
+	}
+
+	void release() {
+		release_block();
+		data = nullptr;
+		count = 0;
+		reserved = 0;
+		bytes = 0;
+		huge_pages = false;
+	}
+
+	static void* allocate(size_t size, size_t alignment) {
+#ifdef _WIN32
+		return _aligned_malloc(size, alignment);
+#else
+		void* block = nullptr;
+		return posix_memalign(&block, alignment, size) == 0 ? block : nullptr;
+#endif
+	}
+
+	void release_block() {
+		if (data == nullptr) {
+			return;
+		}
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
+};
@@ -1,33 +1,43 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include "precision.h"
 
 
 
 
 // contains basic information for each particle
-struct Particle {
+// the position type comes from the precision policy, everything else stays float
+template<typename Precision = SinglePrecision>
+struct ParticleT {
+	using position_t = typename Precision::position_t;
 
 	float radius;
+	float mass;
 	glm::vec3 scale;
-	glm::vec3 position;
+	position_t position;
 	glm::vec3 velocity;
 	glm::vec3 acceleration;
 	glm::vec3 new_acceleration;
 	float dt = 1.f / 120.f; //temporary solution, supposed to be tied to the frame and update rate
+	int rung = 0; //block timestep level, dt = dt_max / 2^rung, only used with TimestepMode::block
+	float potential = 0.f; //per unit mass, only filled on the steps Diagnostics measures
+	int id = -1; //stable, survives compaction, handed out by the particle system
+	bool alive = true; //false = removed, the slot is a massless tombstone until it is reused or compacted away
 
-	Particle(float r, glm::vec3 p, glm::vec3 v) {
+	ParticleT(float r, glm::vec3 p, glm::vec3 v) {
 		radius = r;
-		position = p;
+		mass = 1.f; //the tree treats every particle as mass 1
+		position = position_t(p);
 		velocity = v;
 		acceleration = glm::vec3(0.f);
 		new_acceleration = glm::vec3(0.f);
 		scale = glm::vec3(r);
 	}
 
-	// verlet integration
+	// verlet integration, the step is small and calculated in float, only the sum is in position precision
 	void forces_verlet() {
-		position = position + velocity * dt + acceleration * 0.5f * dt * dt;
+		position += position_t(velocity * dt + acceleration * 0.5f * dt * dt);
 		velocity = velocity + (acceleration + new_acceleration) * (dt * 0.5f);
 
 		acceleration = new_acceleration;
@@ -35,7 +45,9 @@ struct Particle {
 	}
 
 	void move() {
-		position = position + velocity;
+		position += position_t(velocity);
 	}
 };
 
+using Particle = ParticleT<>;
+
@@ -2,163 +2,643 @@
 
 #include <vector>
 #include <random>
+#include <unordered_map>
 #include "particle.h"
 #include "BarnesHut.h"
+#include "timestep.h"
+#include "integrators.h"
+#include "diagnostics.h"
+#include "collision_grid.h"
+#include "contact_batches.h"
+#include "neighbour_list.h"
+#include "direct_sum.h"
+#include "autotune.h"
+#include "initial_conditions.h"
+#include "snapshot.h"
 #include <thread>
 #include <iostream>
 
 
 
-struct Particlesystem {
-	int amount;
+// the integrator and the precision are compile time policies, see integrators.h and precision.h
+template<typename Integrator = VelocityVerlet, typename Precision = SinglePrecision>
+struct ParticlesystemT {
+	using particle_t = ParticleT<Precision>;
+	using position_t = typename Precision::position_t;
+	using integrator_t = Integrator;
+
+	int amount; //slots in particles, tombstones included
 	const float gravitational_constant = 0.06743f;
-	std::vector<Particle> particles;
+	std::vector<particle_t> particles;
+	InitialConditions initial_conditions;
+
+	// runtime insertion / removal, see add_particles and remove_particles
+	std::vector<int> free_slots; //tombstones that add_particles can reuse
+	std::unordered_map<int, int> id_index; //stable id -> slot in particles, only the living ones, ids are never reused
+	int next_id;
+	float compact_fraction; //update() compacts once this fraction of the slots are tombstones
 
 	bool collision_on;
 	bool gravity_on;
 
-	glm::vec3 center_mass;
-	glm::vec3 center_mass_vel;
-	float total_mass;
-
-	float energy;
-
-	Quadtree Qtree;
-
-
-	Particlesystem(int n, bool g, bool c){
+	ForceSolver solver;
+	QuadtreeT<Precision> Qtree;
+	DirectSum direct;
+	Broadphase broadphase;
+	CollisionGrid collision_grid;
+	NeighbourList neighbour_list;
+	std::vector<glm::ivec2> thread_contacts[4]; //contacts found on the tree, per thread
+	std::vector<glm::ivec2> contacts;
+	ContactBatches contact_batches;
+
+	TimestepMode timestep_mode;
+	float dt; //global step for the fixed and adaptive mode
+	float dt_prev; //dt of the last integrator step, the merged half steps need both
+	bool integrator_started; //the integrator did its first (unfused) half step
+	AdaptiveTimestep adaptive;
+	BlockTimesteps block;
+	StepCost cost;
+
+	// per thread maxima of |a|^2 and |v|^2, filled during the force pass
+	float thread_max_acc_sq[4];
+	float thread_max_vel_sq[4];
+	std::vector<int> active; //particles that get new forces in the current substep
+
+	Diagnostics diagnostics;
+	double time; //simulated time since the start, kept in double so long runs do not lose steps
+	long long step_count;
+	bool compute_potential; //the next force pass also sums m * phi into thread_potential
+	double thread_potential[4];
+
+
+	ParticlesystemT(int n, bool g, bool c, const InitialConditions& ic = InitialConditions()){
 		amount = n;
+		initial_conditions = ic;
 		gravity_on = g;
 		collision_on = c;
+		timestep_mode = TimestepMode::fixed;
+		dt = 1.f / 120.f;
+		dt_prev = dt;
+		integrator_started = false;
+		time = 0.0;
+		step_count = 0;
+		compute_potential = false;
+		broadphase = Broadphase::tree;
+		solver = ForceSolver::tree;
+		next_id = 0;
+		compact_fraction = 1.f / 16.f;
+		for (int t = 0; t < 4; t++) {
+			thread_max_acc_sq[t] = 0.f;
+			thread_max_vel_sq[t] = 0.f;
+			thread_potential[t] = 0.0;
+		}
 		spawn();
-		calc_center_mass();
+		build_tree();
 	}
 
-	//spawns random particles, only sets the position, velocity is 0
+	// positions and velocities from the initial conditions preset, the same seed always gives the same particles
 	void spawn() {
+		InitialConditions ic = initial_conditions;
+		ic.gravitational_constant = Qtree.gravitational_constant;
+		ic.softening = Qtree.softening;
+		ic.generate(particles, amount);
 
-		std::random_device rd; // obtain a random number from hardware
-		std::mt19937 gen(rd()); // seed the generator
-		std::uniform_real_distribution<> distr(-1.0, 1.0); // define the range
+		id_index.clear();
+		id_index.reserve(amount);
+		for (int i = 0; i < amount; i++) {
+			particles[i].id = i;
+			id_index[i] = i;
+		}
+		next_id = amount;
+	}
 
-		float r = distr(gen);
-		float x = distr(gen);
-		float y = distr(gen);
-		float z = distr(gen);
-		float vx = 0;
-		float vy = 0;
+	// gives the particle in the slot a new stable id
+	void register_particle(int slot) {
+		particles[slot].id = next_id++;
+		id_index[particles[slot].id] = slot;
+	}
 
-		for (int i = 0; i < amount; i++) {
+	// slot of the particle with this id, -1 if it was removed
+	int index_of(int id) const {
+		auto it = id_index.find(id);
+		return it == id_index.end() ? -1 : it->second;
+	}
+
+	int alive_count() const {
+		return amount - (int)free_slots.size();
+	}
+
+	// O(batch): fills tombstones first, then appends, returns the ids of the new particles
+	// only between two updates, never from inside a force pass
+	std::vector<int> add_particles(const std::vector<particle_t>& batch) {
+		std::vector<int> ids;
+		ids.reserve(batch.size());
+
+		for (const particle_t& p : batch) {
+			int slot;
+			if (!free_slots.empty()) {
+				slot = free_slots.back();
+				free_slots.pop_back();
+				particles[slot] = p;
+			}
+			else {
+				slot = (int)particles.size();
+				particles.push_back(p);
+			}
+			particle_t& added = particles[slot];
+			added.alive = true;
+
+			// with block timesteps a new particle starts on the finest rung and finds its own within a step
+			if (timestep_mode == TimestepMode::block) {
+				added.rung = block.max_rung;
+				added.dt = block.dt_of(added.rung);
+			}
+			register_particle(slot);
+			ids.push_back(added.id);
+		}
+		amount = (int)particles.size();
+		neighbour_list.invalidate();
+		// energy and momentum are not conserved across insertions, the reference of the diagnostics restarts
+		diagnostics.has_initial = false;
+		return ids;
+	}
+
+	// O(batch): turns the particles into tombstones, massless, sizeless and at rest, so every pass can
+	// keep running over them until they are reused or compacted away, unknown ids are ignored
+	void remove_particles(const std::vector<int>& ids) {
+		for (int id : ids) {
+			int slot = index_of(id);
+			if (slot < 0) {
+				continue;
+			}
+			particle_t& p = particles[slot];
+			p.alive = false;
+			p.mass = 0.f;
+			p.radius = 0.f;
+			p.velocity = glm::vec3(0.f);
+			p.acceleration = glm::vec3(0.f);
+			p.new_acceleration = glm::vec3(0.f);
+
+			free_slots.push_back(slot);
+			id_index.erase(id);
+		}
+		neighbour_list.invalidate();
+		diagnostics.has_initial = false;
+	}
+
+	// squeezes the tombstones out, keeps the order of the living particles and moves their ids along
+	void compact() {
+		int write = 0;
+		for (int read = 0; read < amount; read++) {
+			if (!particles[read].alive) {
+				continue;
+			}
+			if (write != read) {
+				particles[write] = particles[read];
+				id_index[particles[write].id] = write;
+			}
+			write++;
+		}
+		particles.erase(particles.begin() + write, particles.end());
+		amount = write;
+		free_slots.clear();
+		neighbour_list.invalidate();
+	}
+
+	// checkpoint of the whole state, see snapshot.h, the tombstones are squeezed out first
+	bool save_snapshot(const std::string& path) {
+		if (!free_slots.empty()) {
+			compact();
+		}
+		return Snapshot::save(*this, path);
+	}
 
-			r = distr(gen);
-			x = distr(gen);
-			y = distr(gen);
-			z = distr(gen);
-			vx = distr(gen);
-			vy = distr(gen);
-			
-			Particle p(0.01f, glm::vec3(x * 10.f, y * 10.f, 0.f), glm::vec3(0.f, 0.f, 0.f));
-			particles.push_back(p);
+	// continues a run from a checkpoint, replaces every particle and the solver settings
+	// the neighbour list and the energy reference start over, the tree is rebuilt for the renderer
+	bool restore_snapshot(const std::string& path) {
+		if (!Snapshot::restore(*this, path)) {
+			return false;
 		}
+		neighbour_list.invalidate();
+		diagnostics.has_initial = false;
+		build_tree();
+		return true;
 	}
 
-	//unused
-	void calc_center_mass() {
-		glm::vec3 weighted_position(0.f);
-		glm::vec3 weighted_velocity(0.f);
+	// creates Quadtree, calculates the forces based on it and calculates the new velocity of the particles
+	// the tree stays alive until the next update, so the renderer can use it
+	void update() {
+		// amortised, most steps have no or only a few tombstones
+		if (!free_slots.empty() && free_slots.size() >= compact_fraction * amount) {
+			compact();
+		}
+
+		cost.begin();
+		bool measure = diagnostics.due(step_count);
+		step_count++;
+
+		if (timestep_mode == TimestepMode::block) {
+			update_block(measure);
+			if (collision_on) {
+				collision_check();
+			}
+			// the last substep kicked every particle half a step ahead of the positions its potential belongs to
+			if (measure) {
+				diagnostics.measure_kinematics(particles, [](const particle_t& p, glm::dvec3& x, glm::dvec3& v) {
+					x = glm::dvec3(p.position);
+					v = glm::dvec3(p.velocity - p.acceleration * (p.dt * 0.5f));
+				});
+				report_energy();
+			}
+			time += block.dt_max;
+			cost.end(block.dt_max);
+			return;
+		}
+
+		// block timesteps have their own kick drift kick, everything else goes through the integrator
+		// the adaptive dt uses the maxima of the last force pass, it has to be known before the step starts
+		if (timestep_mode == TimestepMode::adaptive) {
+			float max_acc_sq = 0.f;
+			float max_vel_sq = 0.f;
+			for (int t = 0; t < 4; t++) {
+				max_acc_sq = glm::max(max_acc_sq, thread_max_acc_sq[t]);
+				max_vel_sq = glm::max(max_vel_sq, thread_max_vel_sq[t]);
+			}
+			dt = adaptive.next_dt(dt, sqrtf(max_acc_sq), sqrtf(max_vel_sq));
+		}
+
+		// the potential comes out of the first force pass, the kinetic part is taken where the integrator
+		// has the velocities at the time of those positions, see integrators.h
+		if (measure && Integrator::measure_before_step) {
+			diagnostics.measure_kinematics(particles);
+		}
+		if (measure && Integrator::potential_in_step) {
+			request_potential();
+		}
+
+		Integrator::step(*this, dt);
+
+		if (measure && !Integrator::measure_before_step) {
+			float h = dt;
+			diagnostics.measure_kinematics(particles, [h](const particle_t& p, glm::dvec3& x, glm::dvec3& v) {
+				Integrator::synchronize(p, h, x, v);
+			});
+			if (!Integrator::potential_in_step) {
+				synchronized_potential();
+			}
+		}
 
-		for (Particle &p : particles) {
-			weighted_position += p.radius * p.position;
-			weighted_velocity += p.velocity * p.radius;
+		if (collision_on) {
+			collision_check();
 		}
-		center_mass = (1.f / total_mass) * weighted_position;
-		center_mass_vel = weighted_velocity / total_mass;
+		if (measure) {
+			report_energy();
+		}
+		time += dt;
+		cost.end(dt);
 	}
 
-	//unused
-	void calc_energy() {
-		float e_pot = 0.f;
-		float e_kin = 0.f;
+	// the next force pass also evaluates the potential of every particle it walks
+	void request_potential() {
+		compute_potential = true;
+		for (int t = 0; t < 4; t++) {
+			thread_potential[t] = 0.0;
+		}
+	}
 
-		for (Particle& p : particles) {
-			e_pot += p.radius * glm::length(p.acceleration) * glm::length(p.position - center_mass);
-			e_kin += p.radius * glm::length(p.velocity);
+	// one more force pass at the synchronised positions of the integrator, only for the potential
+	// the positions are put back bit for bit afterwards, measuring does not change the run
+	void synchronized_potential() {
+		std::vector<position_t> stored(amount);
+		for (int i = 0; i < amount; i++) {
+			particle_t& p = particles[i];
+			glm::dvec3 x, v;
+			Integrator::synchronize(p, dt, x, v);
+			stored[i] = p.position;
+			p.position = position_t(x);
 		}
 
-		energy = e_pot + e_kin;
-		std::cout << "Energy: " << energy << "Potential: " << e_pot << "Kinetic: " << e_kin << std::endl;
+		// the adaptive dt keeps using the maxima of the real pass
+		float max_acc_sq[4], max_vel_sq[4];
+		std::copy(thread_max_acc_sq, thread_max_acc_sq + 4, max_acc_sq);
+		std::copy(thread_max_vel_sq, thread_max_vel_sq + 4, max_vel_sq);
+
+		request_potential();
+		barnes_hut_multi();
+
+		for (int i = 0; i < amount; i++) {
+			particles[i].position = stored[i];
+			particles[i].new_acceleration = glm::vec3(0.f);
+		}
+		std::copy(max_acc_sq, max_acc_sq + 4, thread_max_acc_sq);
+		std::copy(max_vel_sq, max_vel_sq + 4, thread_max_vel_sq);
+	}
+
+	void report_energy() {
+		double sum_mass_phi = 0.0;
+		for (int t = 0; t < 4; t++) {
+			sum_mass_phi += thread_potential[t];
+		}
+		diagnostics.set_potential(sum_mass_phi);
+		diagnostics.finish();
 	}
 
-	//unused
-	void calc_angular_momentum() {
+	// advances the system by block.dt_max, every particle with its own power of two step
+	// kick drift kick leapfrog: all particles drift every substep, only the active ones are kicked
+	// the velocities are half a step ahead of the positions between two kicks
+	// with measure the last substep, where every rung is active, also evaluates the potential
+	void update_block(bool measure = false) {
+
+		if (!block.started) {
+			start_block_timesteps();
+		}
+
+		float dt_min = block.dt_min();
+		// particles may have been added, removed or compacted since the last update, the first build is a full one
+		bool tree_valid = false;
+
+		for (int substep = 0; substep < block.substeps(); substep++) {
+
+			for (particle_t& p : particles) {
+				p.position += position_t(p.velocity * dt_min);
+			}
+
+			active.clear();
+			for (int i = 0; i < amount; i++) {
+				if (block.is_active(particles[i].rung, substep)) {
+					active.push_back(i);
+				}
+			}
+			if (active.empty()) {
+				continue;
+			}
+
+			if (measure && substep == block.substeps() - 1) {
+				request_potential();
+			}
+
+			// the tree needs every particle as a source, but only the active ones are walked
+			// building it costs O(N log N) however few are active, the fine substeps only refit it to the drifted positions
+			if (solver == ForceSolver::direct || !tree_valid || block.rebuild_due(substep)) {
+				prepare_forces();
+				tree_valid = true;
+				block.rebuilds++;
+			}
+			else {
+				Qtree.refit(particles);
+				block.refits++;
+			}
+			traverse_active_multi();
+			compute_potential = false;
+			block.force_evaluations += active.size();
+
+			for (int i : active) {
+				particle_t& p = particles[i];
 
-		float linear_momentum = total_mass * glm::length(center_mass_vel);
-		float angular_momentum = 0.f;
+				// closing half kick of the finished step
+				p.velocity += p.new_acceleration * (p.dt * 0.5f);
 
-		glm::vec3 cross_position;
+				glm::vec3 jerk = (p.new_acceleration - p.acceleration) / p.dt;
+				p.acceleration = p.new_acceleration;
+				p.new_acceleration = glm::vec3(0.f);
 
-		for (Particle& p : particles) {
-			glm::vec3 relative_position = p.position - center_mass;
+				p.rung = block.allowed_rung(p.rung, block.rung_for(p.acceleration, jerk), substep);
+				p.dt = block.dt_of(p.rung);
 
-			glm::vec3 mass_position = p.radius * relative_position;
-			glm::vec3 position_change = relative_position;
+				// opening half kick of the next step
+				p.velocity += p.acceleration * (p.dt * 0.5f);
+			}
 		}
 	}
 
-	// creates Quadtree, calculates the forces based on it and calculates the new velocity of the particles
-	void update() {
+	// forces for everyone, first rungs from the acceleration alone and the first half kick
+	void start_block_timesteps() {
 		barnes_hut_multi();
 
-		for (Particle &p : particles) {
-			p.forces_verlet();
+		for (particle_t& p : particles) {
+			p.acceleration = p.new_acceleration;
+			p.new_acceleration = glm::vec3(0.f);
+			p.rung = block.rung_for(p.acceleration, glm::vec3(0.f));
+			p.dt = block.dt_of(p.rung);
+			p.velocity += p.acceleration * (p.dt * 0.5f);
+		}
+		block.started = true;
+	}
+
+	// helper for the block timesteps, walks the tree for a slice of the active particles
+	void traverse_active(int begin, int end, int thread_nr) {
+		double sum_mass_phi = compute_forces(end - begin, [this, begin](int k) { return active[begin + k]; });
+
+		if (compute_potential) {
+			thread_potential[thread_nr] = sum_mass_phi;
+		}
+	}
+
+	void traverse_active_multi() {
+		int n = (int)active.size();
+
+		// not worth starting threads for a handful of particles on the fine rungs
+		if (n < 256) {
+			traverse_active(0, n, 0);
+			return;
+		}
+
+		int partition = n / 4;
+
+		std::thread t0(&ParticlesystemT::traverse_active, this, 0, partition, 0);
+		std::thread t1(&ParticlesystemT::traverse_active, this, partition, 2 * partition, 1);
+		std::thread t2(&ParticlesystemT::traverse_active, this, 2 * partition, 3 * partition, 2);
+		std::thread t3(&ParticlesystemT::traverse_active, this, 3 * partition, n, 3);
+
+		t0.join();
+		t1.join();
+		t2.join();
+		t3.join();
+	}
+
+	// picks the solver and theta for this machine and problem size, cached in the tuning file, see Autotuner
+	void autotune(const std::string& file, std::ostream* out = &std::cout) {
+		Autotuner tuner;
+		tuner.out = out;
+		Tuning tuning = tuner.load_or_tune(*this, file);
+
+		solver = tuning.solver;
+		Qtree.theta = tuning.theta;
+	}
+
+	// the snapshot of the positions the next force pass reads: the tree, or the packed arrays of the direct sum
+	void prepare_forces() {
+		if (solver == ForceSolver::direct) {
+			direct.gravitational_constant = Qtree.gravitational_constant;
+			direct.softening = Qtree.softening;
+			direct.pack(particles);
+		}
+		else {
+			build_tree();
+		}
+	}
+
+	// new_acceleration (and the potential, if asked for) of the particles index(0) .. index(count - 1)
+	// returns the sum of m * phi over them
+	template<typename Index>
+	double compute_forces(int count, const Index& index) {
+		double sum_mass_phi = 0.0;
+
+		if (solver == ForceSolver::direct) {
+			if (compute_potential) {
+				direct.accelerations_potential(count, index, [&](int k, glm::vec3 a, double phi) {
+					particle_t& p = particles[index(k)];
+					p.new_acceleration = p.alive ? a : glm::vec3(0.f);
+					p.potential = (float)phi;
+					sum_mass_phi += p.mass * p.potential;
+				});
+			}
+			else {
+				direct.accelerations(count, index, [&](int k, glm::vec3 a) {
+					particle_t& p = particles[index(k)];
+					p.new_acceleration = p.alive ? a : glm::vec3(0.f);
+				});
+			}
+			return sum_mass_phi;
+		}
+
+		for (int k = 0; k < count; k++) {
+			particle_t& p = particles[index(k)];
+			// tombstones feel no force, so they never drift away from where they were removed
+			if (!p.alive) {
+				p.new_acceleration = glm::vec3(0.f);
+				continue;
+			}
+			if (compute_potential) {
+				p.new_acceleration = Qtree.calc_forces_potential(p.position, 1.f, p.potential);
+				sum_mass_phi += p.mass * p.potential;
+			}
+			else {
+				p.new_acceleration = Qtree.calc_forces_fast(p.position, 1.f);
+			}
+		}
+		return sum_mass_phi;
+	}
+
+	// rebuilds the Quadtree from the current positions
+	void build_tree() {
+		// the root quad is fitted around the particles, a fixed one loses everything that leaves it
+		glm::vec2 lo(INFINITY), hi(-INFINITY);
+		for (const particle_t& p : particles) {
+			if (p.alive) {
+				lo = glm::min(lo, glm::vec2(p.position));
+				hi = glm::max(hi, glm::vec2(p.position));
+			}
 		}
+		float size = lo.x <= hi.x ? glm::max(hi.x - lo.x, hi.y - lo.y) * 1.001f + 1e-3f : 100.f;
+		glm::vec3 center = lo.x <= hi.x ? glm::vec3(0.5f * (lo + hi), 0.f) : glm::vec3(0.f);
+
+		// the arena is emptied, memory is still allocated
+		Qtree.reset(center, size, alive_count());
 
-		// Vector is emptied, memory is still allocated
-		Qtree.nodes.clear();
-		Qtree.init_root_node();
+		for (int i = 0; i < amount; i++) {
+			if (particles[i].alive) {
+				Qtree.insert(particles[i].position, 1.f, i, particles[i].radius);
+			}
+		}
 	}
 
 	// barnes hut single thread
 	void barnes_hut() {
 
 		//construct the tree
-		for (int i = 0; i < amount; i++) {
-			Qtree.insert(particles[i].position, 1.f);
-		}
+		prepare_forces();
 
 		//traverse about 10x longer than construct
-		for (int i = 0; i < amount; i++) {
-			particles[i].new_acceleration = Qtree.calc_forces_fast(particles[i].position, 1.f);
-		}
+		compute_forces(amount, [](int k) { return k; });
 	}
 
 
-	// helper fuction for multithreading
+	// helper fuction for multithreading, also keeps the largest |a| and |v| of its slice for the adaptive timestep
 	void traverse_multi(int n, int thread_nr) {
-		for (int i = n * thread_nr; i < (thread_nr + 1) * n; i++) {
-			particles[i].new_acceleration = Qtree.calc_forces_fast(particles[i].position, 1.f);
+		traverse_fused(n, thread_nr, [](particle_t&) {});
+	}
+
+	// same walk, finish(p) is called as soon as the force of p is known
+	template<typename Finish>
+	void traverse_fused(int n, int thread_nr, const Finish& finish) {
+		float max_acc_sq = 0.f;
+		float max_vel_sq = 0.f;
+
+		// the last thread also takes the remainder
+		int end = thread_nr == 3 ? amount : (thread_nr + 1) * n;
+
+		double sum_mass_phi = 0.0;
+
+		// forces a tile at a time (the direct sum wants them in blocks), then every particle of the tile is finished
+		for (int tile = n * thread_nr; tile < end; tile += DirectSum::tile_i) {
+			int tile_end = glm::min(end, tile + DirectSum::tile_i);
+			sum_mass_phi += compute_forces(tile_end - tile, [tile](int k) { return tile + k; });
+
+			for (int i = tile; i < tile_end; i++) {
+				glm::vec3 acc = particles[i].new_acceleration;
+
+				max_acc_sq = glm::max(max_acc_sq, glm::dot(acc, acc));
+				max_vel_sq = glm::max(max_vel_sq, glm::dot(particles[i].velocity, particles[i].velocity));
+
+				finish(particles[i]);
+			}
+		}
+
+		thread_max_acc_sq[thread_nr] = max_acc_sq;
+		thread_max_vel_sq[thread_nr] = max_vel_sq;
+		if (compute_potential) {
+			thread_potential[thread_nr] = sum_mass_phi;
 		}
 	}
 
 	// barnes hut multithreading
 	void barnes_hut_multi() {
 
-		for (int i = 0; i < amount; i++) {
-			Qtree.insert(particles[i].position, 1.f);
-		}
+		prepare_forces();
+		force_pass();
+	}
+
+	// new_acceleration of every particle from the tree or the packed arrays prepare_forces() left behind
+	void force_pass() {
 
 		int partition = amount / 4;
 
-		std::thread t0(&Particlesystem::traverse_multi, this, partition, 0);
-		std::thread t1(&Particlesystem::traverse_multi, this, partition, 1);
-		std::thread t2(&Particlesystem::traverse_multi, this, partition, 2);
-		std::thread t3(&Particlesystem::traverse_multi, this, partition, 3);
+		std::thread t0(&ParticlesystemT::traverse_multi, this, partition, 0);
+		std::thread t1(&ParticlesystemT::traverse_multi, this, partition, 1);
+		std::thread t2(&ParticlesystemT::traverse_multi, this, partition, 2);
+		std::thread t3(&ParticlesystemT::traverse_multi, this, partition, 3);
 
 		t0.join();
 		t1.join();
 		t2.join();
 		t3.join();
 
+		// only the first pass of a step is measured, Yoshida4 walks the tree three times
+		compute_potential = false;
+	}
+
+	// force calculation and integration in a single pass per particle, no barrier between the two
+	// the tree keeps its own copy of every position, so it is generation n while the workers
+	// kick and drift their own particles straight into generation n + 1
+	template<typename Finish>
+	void fused_pass(const Finish& finish) {
+
+		prepare_forces();
+
+		int partition = amount / 4;
+
+		std::thread t0([&]() { traverse_fused(partition, 0, finish); });
+		std::thread t1([&]() { traverse_fused(partition, 1, finish); });
+		std::thread t2([&]() { traverse_fused(partition, 2, finish); });
+		std::thread t3([&]() { traverse_fused(partition, 3, finish); });
+
+		t0.join();
+		t1.join();
+		t2.join();
+		t3.join();
+
+		compute_potential = false;
 	}
 
 	// loop for naive force calculation approach, collision possible, unused
@@ -166,11 +646,11 @@ struct Particlesystem {
 
 		for (int i = 0; i < amount; i++) {
 
-			Particle& p1 = particles[i];
+			particle_t& p1 = particles[i];
 
 			for (int j = i + 1; j < amount; j++) {
 
-				Particle& p2 = particles[j];
+				particle_t& p2 = particles[j];
 				
 				if (gravity_on) {
 					calc_acceleration(p1, p2);
@@ -187,93 +667,120 @@ struct Particlesystem {
 			}
 		}
 
-	// naive n^n calculation of the forces between the particles
+	// exact forces by direct summation, the reference the tree is measured against
 	void calc_acceleration_brute() {
-		
-		for (int i = 0; i < amount; i++) {
+		direct.gravitational_constant = Qtree.gravitational_constant;
+		direct.softening = Qtree.softening;
+		direct.pack(particles);
 
-			glm::vec3 vector(0.f);
-			glm::vec3 normal_vector(0.f);
-			float distance = 0;
-			float acceleration_scalar_1 = 0;
-			float acceleration_scalar_2 = 0;
-			//glm::vec3 accelerations(0.f);
+		int partition = amount / 4;
 
-			for (int j = i; j < amount; j++) {
-				
-				if (particles[i].position != particles[j].position) {
-					vector = particles[j].position - particles[i].position;
-					normal_vector = glm::normalize(vector);
-					distance = glm::length(vector);
+		auto sum = [this, partition](int thread_nr) {
+			int begin = thread_nr * partition;
+			int end = thread_nr == 3 ? amount : begin + partition;
+			direct.accelerations(end - begin, [begin](int k) { return begin + k; }, [this, begin](int k, glm::vec3 a) {
+				particles[begin + k].new_acceleration = a;
+			});
+		};
 
-					acceleration_scalar_1 = gravitational_constant * particles[j].radius / ((distance * distance) + 0.001);
-					acceleration_scalar_2 = gravitational_constant * particles[i].radius / ((distance * distance) + 0.001);
+		std::thread t0(sum, 0);
+		std::thread t1(sum, 1);
+		std::thread t2(sum, 2);
+		std::thread t3(sum, 3);
 
-					particles[i].new_acceleration += acceleration_scalar_1 * normal_vector;
-					particles[j].new_acceleration -= acceleration_scalar_2 * normal_vector;
-				}
-			}
-			//particles[i].new_acceleration = accelerations;
-		}
+		t0.join();
+		t1.join();
+		t2.join();
+		t3.join();
 	}
 
-	// unused
+	// bounces overlapping particles off each other, the broadphase finds the overlapping pairs
+	// so only nearby particles are ever compared instead of all n^2 pairs
+	// the pairs are resolved batch by batch, a batch has no shared particles, so the order of the resolutions
+	// is fixed by the colouring: deterministic and independent of the thread count, but not the list order
 	void collision_check() {
+		const std::vector<glm::ivec2>& found = find_contacts();
 
-		float distance = 0;
-		float dot1 = 0;
-		float dot2 = 0;
+		contact_batches.build(found, amount);
+		contact_batches.resolve(found, [this](glm::ivec2 c) {
+			resolve_collision(particles[c.x], particles[c.y]);
+		});
+	}
 
-		glm::vec3 p2p1 = glm::vec3(0.f);
-		glm::vec3 p1p2 = glm::vec3(0.f);
+	const std::vector<glm::ivec2>& find_contacts() {
+		switch (broadphase) {
+		case Broadphase::grid:
+			return find_contacts_grid();
+		case Broadphase::list:
+			return find_contacts_list();
+		default:
+			// the tree is only fresh when it solved gravity
+			return solver == ForceSolver::tree ? find_contacts_tree() : find_contacts_grid();
+		}
+	}
 
-		float mass_factor1 = 0;
-		float mass_factor2 = 0;
+	// needs no structure of its own
+	const std::vector<glm::ivec2>& find_contacts_grid() {
+		collision_grid.build(particles);
+		collision_grid.find_contacts(particles);
+		return collision_grid.contacts;
+	}
 
-		float distance_sq = 0;
-		
-		for (int i = 0; i < amount; i++) {
+	// the cached pairs, the grid is only needed on the steps the list gets rebuilt
+	const std::vector<glm::ivec2>& find_contacts_list() {
+		neighbour_list.update(particles, collision_grid);
+		neighbour_list.find_contacts(particles);
+		return neighbour_list.contacts;
+	}
 
-			Particle& p1 = particles[i];
+	// reuses the tree of the last force pass, the queries grow by how far the particles moved since it was built
+	const std::vector<glm::ivec2>& find_contacts_tree() {
+		float slack = Qtree.max_drift(particles);
 
-			for (int j = i + 1; j < amount; j++) {
-				
-				Particle& p2 = particles[j];
-				distance = glm::length(p2.position - p1.position);
-				
-				if (distance < (p2.radius + p1.radius)) {
-					
-					dot1 = glm::dot(p1.velocity - p2.velocity, p1.position - p2.position);
-					dot2 = glm::dot(p2.velocity - p1.velocity, p2.position - p1.position);
+		// a few levels of the dual walk as tasks, dealt out round robin so the result does not depend on timing
+		std::vector<glm::ivec2> tasks = Qtree.pair_tasks(3, 2.f * slack);
 
-					distance_sq = distance * distance;
+		auto query = [this, slack, &tasks](int thread_nr) {
+			thread_contacts[thread_nr].clear();
+			for (size_t k = thread_nr; k < tasks.size(); k += 4) {
+				Qtree.find_contacts(particles, tasks[k], slack, thread_contacts[thread_nr]);
+			}
+		};
 
-					p1p2 = p1.position - p2.position;
-					p2p1 = p2.position - p1.position;
+		std::thread t0(query, 0);
+		std::thread t1(query, 1);
+		std::thread t2(query, 2);
+		std::thread t3(query, 3);
 
-					mass_factor1 = 2 * p2.radius / (p1.radius + p2.radius);
-					mass_factor2 = 2 * p1.radius / (p1.radius + p2.radius);
+		t0.join();
+		t1.join();
+		t2.join();
+		t3.join();
 
-					p1.velocity = p1.velocity - mass_factor1 * (dot1 / distance_sq) * p1p2;
-					p2.velocity = p2.velocity - mass_factor2 * (dot2 / distance_sq) * p2p1;
-				}
-			}
+		contacts.clear();
+		for (int t = 0; t < 4; t++) {
+			contacts.insert(contacts.end(), thread_contacts[t].begin(), thread_contacts[t].end());
 		}
+		return contacts;
 	}
 
-	// unused
-	void resolve_collision(Particle& p1, Particle& p2) {
-		float distance = glm::length(p2.position - p1.position);
+	// elastic collision of two discs, the radius stands in for the mass
+	void resolve_collision(particle_t& p1, particle_t& p2) {
+		glm::vec3 p2p1 = glm::vec3(p2.position - p1.position);
+		float distance = glm::length(p2p1);
 
 		if (distance < (p2.radius + p1.radius)) {
 
-			float dot1 = glm::dot(p1.velocity - p2.velocity, p1.position - p2.position);
-			float dot2 = glm::dot(p2.velocity - p1.velocity, p2.position - p1.position);
+			glm::vec3 p1p2 = -p2p1;
 
-			float distance_sq = distance * distance;
+			float dot1 = glm::dot(p1.velocity - p2.velocity, p1p2);
+			float dot2 = glm::dot(p2.velocity - p1.velocity, p2p1);
 
-			glm::vec3 p1p2 = p1.position - p2.position;
-			glm::vec3 p2p1 = p2.position - p1.position;
+			float distance_sq = distance * distance;
+			// particles on top of each other have no normal to bounce along, dividing by 0 would make them nan
+			if (distance_sq == 0.f) {
+				return;
+			}
 
 			float mass_factor1 = 2 * p2.radius / (p1.radius + p2.radius);
 			float mass_factor2 = 2 * p1.radius / (p1.radius + p2.radius);
@@ -284,7 +791,7 @@ struct Particlesystem {
 	}
 
 	// unused, helper for previous naive forces and collision simulation
-	void calc_acceleration(Particle& p1, Particle& p2) {
+	void calc_acceleration(particle_t& p1, particle_t& p2) {
 
 		if (p1.position != p2.position) {
 			glm::vec3 vector = p2.position - p1.position;
@@ -299,3 +806,5 @@ struct Particlesystem {
 		}
 	}
 };
+
+using Particlesystem = ParticlesystemT<>;
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+
+/* precision policies, decide how positions are stored and how the forces on a particle are summed
+	the pairwise interactions are always evaluated in float, relative to the sink particle,
+	the difference of two nearby positions is small, so float loses nothing there
+*/
+
+// everything in float, the original behaviour
+struct SinglePrecision {
+	using position_t = glm::vec3;
+	using accumulator_t = glm::vec3;
+};
+
+// positions, tree mass moments and per particle force sums in double
+// float interactions keep the throughput, long runs no longer drift from rounding in the positions
+struct MixedPrecision {
+	using position_t = glm::dvec3;
+	using accumulator_t = glm::dvec3;
+};
@@ -21,6 +21,29 @@ struct Circle {
 		init_vertices();
 	}
 
+	// smallest resolution whose edges stay within max_error pixels of the real circle
+	static int lod_resolution(float radius_px, float max_error = 0.5f, int min_res = 3, int max_res = 64) {
+		if (radius_px <= max_error) {
+			return min_res;
+		}
+		const float PI = acos(-1.0f);
+		int res = (int)ceilf(PI / acosf(1.f - max_error / radius_px));
+
+		if (res < min_res) return min_res;
+		if (res > max_res) return max_res;
+		return res;
+	}
+
+	// rebuilds the vertices only if the resolution changed, returns true if it did
+	bool set_resolution(int res) {
+		if (res == resolution) {
+			return false;
+		}
+		resolution = res;
+		init_vertices();
+		return true;
+	}
+
 	void init_vertices() {
 		const float PI = acos(-1.0f);
 		float angleStep = 2 * PI / resolution;
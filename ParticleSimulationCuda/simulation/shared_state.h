@@ -0,0 +1,406 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <glm/glm.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+// a named block of shared memory, shm_open on posix, a pagefile backed mapping on windows
+// the creator removes the name again, processes that are attached keep their mapping until they detach
+struct SharedMemory {
+
+	void* data;
+	size_t size;
+	bool owner;
+	std::string name;
+
+#ifdef _WIN32
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+
+	SharedMemory() : data(nullptr), size(0), owner(false) {
+#ifdef _WIN32
+		mapping = NULL;
+#else
+		fd = -1;
+#endif
+	}
+
+	~SharedMemory() {
+		close();
+	}
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	// posix names start with a slash, windows names are local to the session
+	static std::string system_name(const std::string& n) {
+#ifdef _WIN32
+		return "Local\\" + n;
+#else
+		return "/" + n;
+#endif
+	}
+
+	// creates (or replaces) the block with bytes bytes, zero filled
+	bool create(const std::string& n, size_t bytes) {
+		close();
+		name = system_name(n);
+		size = bytes;
+		owner = true;
+
+#ifdef _WIN32
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32), (DWORD)(bytes & 0xffffffffull), name.c_str());
+		if (mapping == NULL) {
+			close();
+			return false;
+		}
+		data = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, bytes);
+#else
+		shm_unlink(name.c_str());
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) {
+			close();
+			return false;
+		}
+		data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// maps a block someone else created, read only
+	bool attach(const std::string& n) {
+		close();
+		name = system_name(n);
+		owner = false;
+
+#ifdef _WIN32
+		mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+		if (mapping == NULL) {
+			return false;
+		}
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		MEMORY_BASIC_INFORMATION info;
+		if (data != nullptr && VirtualQuery(data, &info, sizeof(info)) != 0) {
+			size = info.RegionSize;
+		}
+#else
+		fd = shm_open(name.c_str(), O_RDONLY, 0);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+			close();
+			return false;
+		}
+		size = (size_t)st.st_size;
+		data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data != nullptr) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping != NULL) {
+			CloseHandle(mapping);
+		}
+		mapping = NULL;
+#else
+		if (data != nullptr) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+		if (owner && !name.empty()) {
+			shm_unlink(name.c_str());
+		}
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+		owner = false;
+	}
+};
+
+/* layout of the shared block, little endian, everything 64 byte aligned
+	SharedStateHeader
+	slot_count slots of slot_bytes each: SharedSlotHeader, then float positions[3 * capacity], then int32 ids[capacity]
+	the publisher writes the slots round robin, published counts the finished publications,
+	the newest one is in slot (published - 1) % slot_count
+	magic is stored last with release, a reader loads it with acquire before it looks at any other field
+	every slot is a seqlock: sequence is odd while the slot is written, a reader that sees the same even
+	sequence before and after reading got a consistent copy, the writer never waits for anyone
+*/
+struct SharedStateHeader {
+	std::atomic<uint64_t> magic;	// "NBSHARED" as little endian bytes, 0 until the header is complete
+	uint32_t version;
+	uint32_t slot_count;
+	uint64_t capacity;				// particles per slot
+	uint64_t slot_bytes;
+	uint64_t slots_offset;
+	uint8_t padding[24];
+	std::atomic<uint64_t> published;	// own cache line, the only field that changes
+	uint8_t padding_published[56];
+};
+
+struct SharedSlotHeader {
+	std::atomic<uint64_t> sequence;
+	uint64_t count;
+	int64_t step;
+	double time;
+	uint8_t padding[32];
+};
+
+// the atomics are shared between processes, that only works if they are plain 64 bit words without a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics have to be lock free");
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomics are shared as plain 64 bit words");
+
+struct SharedState {
+	static const uint32_t version = 1;
+	static const uint64_t magic = 0x444552414853424Eull; //"NBSHARED"
+
+	static size_t align(size_t bytes) {
+		return (bytes + 63) & ~(size_t)63;
+	}
+
+	static size_t positions_offset() {
+		return align(sizeof(SharedSlotHeader));
+	}
+
+	static size_t ids_offset(uint64_t capacity) {
+		return positions_offset() + align((size_t)capacity * 3 * sizeof(float));
+	}
+
+	static size_t slot_bytes(uint64_t capacity) {
+		return align(ids_offset(capacity) + (size_t)capacity * sizeof(int32_t));
+	}
+};
+
+/* publishes the latest positions and ids of a running system for other local processes
+	publish() copies the living particles into the next slot of the ring, it never blocks on readers
+	capacity is fixed when the block is created, a system that grows beyond it publishes its first capacity particles
+*/
+struct SharedStatePublisher {
+
+	SharedMemory memory;
+	SharedStateHeader* header;
+	uint64_t capacity;
+	uint32_t slot_count;
+	bool warned;
+
+	SharedStatePublisher() : header(nullptr), capacity(0), slot_count(0), warned(false) {};
+
+	bool open(const std::string& name, uint64_t max_particles, uint32_t slots = 4) {
+		capacity = max_particles;
+		slot_count = glm::max(2u, slots);
+		size_t slots_offset = SharedState::align(sizeof(SharedStateHeader));
+		size_t bytes = slots_offset + slot_count * SharedState::slot_bytes(capacity);
+
+		if (!memory.create(name, bytes)) {
+			std::cerr << "ERROR::SHARED_STATE::CANNOT_CREATE " << name << std::endl;
+			header = nullptr;
+			return false;
+		}
+
+		header = new (memory.data) SharedStateHeader();
+		header->magic.store(0, std::memory_order_relaxed);
+		header->version = SharedState::version;
+		header->slot_count = slot_count;
+		header->capacity = capacity;
+		header->slot_bytes = SharedState::slot_bytes(capacity);
+		header->slots_offset = slots_offset;
+		header->published.store(0, std::memory_order_relaxed);
+		for (uint32_t k = 0; k < slot_count; k++) {
+			new (slot(k)) SharedSlotHeader();
+			slot(k)->sequence.store(0, std::memory_order_relaxed);
+		}
+		// readers check the magic first, so they never see a half initialised header
+		header->magic.store(SharedState::magic, std::memory_order_release);
+		return true;
+	}
+
+	SharedSlotHeader* slot(uint32_t k) {
+		return (SharedSlotHeader*)((char*)memory.data + header->slots_offset + k * header->slot_bytes);
+	}
+
+	template<typename System>
+	void publish(const System& s) {
+		if (header == nullptr) {
+			return;
+		}
+		uint64_t published = header->published.load(std::memory_order_relaxed);
+		SharedSlotHeader* target = slot((uint32_t)(published % slot_count));
+		float* position = (float*)((char*)target + SharedState::positions_offset());
+		int32_t* id = (int32_t*)((char*)target + SharedState::ids_offset(capacity));
+
+		uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+		target->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		uint64_t k = 0;
+		for (const auto& p : s.particles) {
+			if (!p.alive) {
+				continue;
+			}
+			if (k == capacity) {
+				if (!warned) {
+					std::cerr << "WARNING::SHARED_STATE::CAPACITY only the first " << capacity << " particles are published" << std::endl;
+					warned = true;
+				}
+				break;
+			}
+			position[3 * k + 0] = (float)p.position.x;
+			position[3 * k + 1] = (float)p.position.y;
+			position[3 * k + 2] = (float)p.position.z;
+			id[k] = p.id;
+			k++;
+		}
+		target->count = k;
+		target->step = s.step_count;
+		target->time = s.time;
+
+		target->sequence.store(sequence + 2, std::memory_order_release);
+		header->published.store(published + 1, std::memory_order_release);
+	}
+
+	void close() {
+		memory.close();
+		header = nullptr;
+	}
+};
+
+/* the reader side, attach and detach at any time, several readers at once are fine
+	view() hands out pointers straight into the shared block, valid() tells afterwards if the writer
+	came around to that slot in the meantime, with the default four slots that takes three more publications
+	copy() is the simple version, it retries until it got a consistent copy
+*/
+struct SharedStateReader {
+
+	struct View {
+		const float* positions; // x y z per particle
+		const int32_t* ids;
+		uint64_t count;
+		int64_t step;
+		double time;
+		uint64_t publication; //1 for the first publication of the run, grows by one per publish()
+
+		uint32_t slot;
+		uint64_t sequence;
+	};
+
+	SharedMemory memory;
+	const SharedStateHeader* header;
+
+	SharedStateReader() : header(nullptr) {};
+
+	bool attach(const std::string& name) {
+		if (!memory.attach(name) || memory.size < sizeof(SharedStateHeader)) {
+			memory.close();
+			return false;
+		}
+		header = (const SharedStateHeader*)memory.data;
+		// the rest of the header is only complete once the magic is there
+		if (header->magic.load(std::memory_order_acquire) != SharedState::magic || header->version != SharedState::version ||
+			memory.size < header->slots_offset + header->slot_count * header->slot_bytes) {
+			detach();
+			return false;
+		}
+		return true;
+	}
+
+	void detach() {
+		memory.close();
+		header = nullptr;
+	}
+
+	bool attached() const {
+		return header != nullptr;
+	}
+
+	const SharedSlotHeader* slot(uint32_t k) const {
+		return (const SharedSlotHeader*)((const char*)memory.data + header->slots_offset + k * header->slot_bytes);
+	}
+
+	// the newest finished publication, false if nothing was published yet or the writer is in the slot right now
+	bool view(View& v) const {
+		uint64_t published = header->published.load(std::memory_order_acquire);
+		if (published == 0) {
+			return false;
+		}
+		v.publication = published;
+		v.slot = (uint32_t)((published - 1) % header->slot_count);
+		const SharedSlotHeader* s = slot(v.slot);
+
+		v.sequence = s->sequence.load(std::memory_order_acquire);
+		if (v.sequence & 1) {
+			return false;
+		}
+		v.count = glm::min(s->count, header->capacity);
+		v.step = s->step;
+		v.time = s->time;
+		v.positions = (const float*)((const char*)s + SharedState::positions_offset());
+		v.ids = (const int32_t*)((const char*)s + SharedState::ids_offset(header->capacity));
+		return valid(v);
+	}
+
+	// true if nothing in the view was overwritten up to now
+	bool valid(const View& v) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot(v.slot)->sequence.load(std::memory_order_relaxed) == v.sequence;
+	}
+
+	// a consistent copy of the newest publication
+	bool copy(std::vector<glm::vec3>& positions, std::vector<int>& ids, View& v, int attempts = 100) const {
+		for (int attempt = 0; attempt < attempts; attempt++) {
+			if (!view(v)) {
+				continue;
+			}
+			positions.resize((size_t)v.count);
+			ids.resize((size_t)v.count);
+			std::memcpy(positions.data(), v.positions, (size_t)v.count * 3 * sizeof(float));
+			std::memcpy(ids.data(), v.ids, (size_t)v.count * sizeof(int32_t));
+			if (valid(v)) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
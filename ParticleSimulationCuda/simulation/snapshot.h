@@ -0,0 +1,352 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <glm/glm.hpp>
+
+#include "mapped_file.h"
+#include "timestep.h"
+#include "direct_sum.h"
+#include "integrators.h"
+
+
+/* binary snapshot / checkpoint, little endian
+	a fixed header, then one column per field, every column starts on a 64 byte boundary
+
+		position		count * 3 * position_bytes	(float or double, whatever the run used)
+		velocity		count * 3 * float
+		acceleration	count * 3 * float
+		mass, radius	count * float
+		dt				count * float				(own step of the particle, block timesteps)
+		id, rung		count * int32
+
+	written through a mapping of the output file and read back through a read only mapping,
+	nothing is parsed, the pages come in from disk while the columns are copied into the particles
+*/
+enum SnapshotColumn {
+	snapshot_position,
+	snapshot_velocity,
+	snapshot_acceleration,
+	snapshot_mass,
+	snapshot_radius,
+	snapshot_dt,
+	snapshot_id,
+	snapshot_rung,
+	snapshot_column_count
+};
+
+struct SnapshotHeader {
+	char magic[8];				// "NBODYSNP"
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t file_size;
+	uint64_t count;
+	uint32_t position_bytes;	// 4 or 8 per component
+	uint32_t timestep_mode;
+	uint32_t solver;
+	uint32_t flags;				// bit 0: integrator started, bit 1: block timesteps started
+
+	double time;
+	int64_t step;
+	int64_t next_id;
+	float dt;
+	float theta;
+	float softening;
+	float gravitational_constant;
+	float block_dt_max;
+	int32_t block_max_rung;
+
+	uint64_t offset[snapshot_column_count];
+	char integrator[32];
+};
+
+struct Snapshot {
+	static const uint32_t version = 1;
+	static const int thread_count = 4;
+
+	static size_t column_bytes(int column, uint64_t count, uint32_t position_bytes) {
+		switch (column) {
+		case snapshot_position:
+			return (size_t)count * 3 * position_bytes;
+		case snapshot_velocity:
+		case snapshot_acceleration:
+			return (size_t)count * 3 * sizeof(float);
+		default:
+			return (size_t)count * 4;
+		}
+	}
+
+	static size_t align(size_t offset) {
+		return (offset + 63) & ~(size_t)63;
+	}
+
+	// fills in the column offsets and the file size
+	static void layout(SnapshotHeader& header) {
+		size_t offset = align(sizeof(SnapshotHeader));
+		for (int c = 0; c < snapshot_column_count; c++) {
+			header.offset[c] = offset;
+			offset = align(offset + column_bytes(c, header.count, header.position_bytes));
+		}
+		header.file_size = offset;
+	}
+
+	// runs f(begin, end) on slices of count particles
+	template<typename F>
+	static void parallel(size_t count, const F& f) {
+		size_t partition = (count + thread_count - 1) / thread_count;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++) {
+			size_t begin = glm::min(count, t * partition);
+			size_t end = glm::min(count, begin + partition);
+			threads.emplace_back([&f, begin, end]() { f(begin, end); });
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+	}
+
+	// writes into <path>.tmp, flushes it and renames it over path at the end, so a crash at any point keeps the last good checkpoint
+	// the particles have to be dense, the system compacts before calling this
+	template<typename System>
+	static bool save(const System& s, const std::string& path) {
+		using scalar_t = typename System::position_t::value_type;
+
+		SnapshotHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "NBODYSNP", 8);
+		header.version = version;
+		header.header_size = sizeof(SnapshotHeader);
+		header.count = (uint64_t)s.amount;
+		header.position_bytes = sizeof(scalar_t);
+		header.timestep_mode = (uint32_t)s.timestep_mode;
+		header.solver = (uint32_t)s.solver;
+		header.flags = (s.integrator_started ? 1u : 0u) | (s.block.started ? 2u : 0u);
+		header.time = s.time;
+		header.step = s.step_count;
+		header.next_id = s.next_id;
+		header.dt = s.dt;
+		header.theta = s.Qtree.theta;
+		header.softening = s.Qtree.softening;
+		header.gravitational_constant = s.Qtree.gravitational_constant;
+		header.block_dt_max = s.block.dt_max;
+		header.block_max_rung = s.block.max_rung;
+		std::strncpy(header.integrator, System::integrator_t::name(), sizeof(header.integrator) - 1);
+		layout(header);
+
+		std::string temporary = path + ".tmp";
+		{
+			MappedFile file;
+			if (!file.create(temporary, header.file_size)) {
+				std::cerr << "ERROR::SNAPSHOT::CANNOT_CREATE " << temporary << std::endl;
+				return false;
+			}
+			char* base = (char*)file.data;
+			std::memcpy(base, &header, sizeof(header));
+
+			scalar_t* position = (scalar_t*)(base + header.offset[snapshot_position]);
+			float* velocity = (float*)(base + header.offset[snapshot_velocity]);
+			float* acceleration = (float*)(base + header.offset[snapshot_acceleration]);
+			float* mass = (float*)(base + header.offset[snapshot_mass]);
+			float* radius = (float*)(base + header.offset[snapshot_radius]);
+			float* dt = (float*)(base + header.offset[snapshot_dt]);
+			int32_t* id = (int32_t*)(base + header.offset[snapshot_id]);
+			int32_t* rung = (int32_t*)(base + header.offset[snapshot_rung]);
+
+			parallel(s.particles.size(), [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					const typename System::particle_t& p = s.particles[i];
+					for (int k = 0; k < 3; k++) {
+						position[3 * i + k] = p.position[k];
+						velocity[3 * i + k] = p.velocity[k];
+						acceleration[3 * i + k] = p.acceleration[k];
+					}
+					mass[i] = p.mass;
+					radius[i] = p.radius;
+					dt[i] = p.dt;
+					id[i] = p.id;
+					rung[i] = p.rung;
+				}
+			});
+
+			// the rename must not overtake the data, or a crash leaves a checkpoint with holes
+			if (!file.flush()) {
+				std::cerr << "ERROR::SNAPSHOT::CANNOT_FLUSH " << temporary << std::endl;
+				return false;
+			}
+		}
+
+		if (!MappedFile::replace(temporary, path)) {
+			std::cerr << "ERROR::SNAPSHOT::CANNOT_RENAME " << temporary << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	static bool known_integrator(const char* integrator) {
+		return std::strcmp(integrator, VelocityVerlet::name()) == 0 || std::strcmp(integrator, LeapfrogKDK::name()) == 0
+			|| std::strcmp(integrator, LeapfrogDKD::name()) == 0 || std::strcmp(integrator, Yoshida4::name()) == 0;
+	}
+
+	// moves p to the time where the velocities and positions of the integrator that wrote it agree
+	template<typename P>
+	static void synchronize_saved(const char* integrator, P& p, float dt) {
+		glm::dvec3 x, v;
+		if (std::strcmp(integrator, VelocityVerlet::name()) == 0) {
+			VelocityVerlet::synchronize(p, dt, x, v);
+		}
+		else if (std::strcmp(integrator, LeapfrogKDK::name()) == 0) {
+			LeapfrogKDK::synchronize(p, dt, x, v);
+		}
+		else if (std::strcmp(integrator, LeapfrogDKD::name()) == 0) {
+			LeapfrogDKD::synchronize(p, dt, x, v);
+		}
+		else if (std::strcmp(integrator, Yoshida4::name()) == 0) {
+			Yoshida4::synchronize(p, dt, x, v);
+		}
+		else {
+			return;
+		}
+		p.position = typename P::position_t(x);
+		p.velocity = glm::vec3(v);
+	}
+
+	// maps the file and fills the particles straight from the columns, the solver settings come back as well
+	template<typename System>
+	static bool restore(System& s, const std::string& path) {
+		using particle_t = typename System::particle_t;
+		using position_t = typename System::position_t;
+
+		MappedFile file;
+		if (!file.open_read(path)) {
+			std::cerr << "ERROR::SNAPSHOT::CANNOT_OPEN " << path << std::endl;
+			return false;
+		}
+		const char* base = (const char*)file.data;
+
+		SnapshotHeader header;
+		if (file.size < sizeof(header)) {
+			std::cerr << "ERROR::SNAPSHOT::TRUNCATED " << path << std::endl;
+			return false;
+		}
+		std::memcpy(&header, base, sizeof(header));
+
+		if (std::memcmp(header.magic, "NBODYSNP", 8) != 0 || header.version != version || header.header_size != sizeof(SnapshotHeader)) {
+			std::cerr << "ERROR::SNAPSHOT::UNKNOWN_FORMAT " << path << std::endl;
+			return false;
+		}
+		if ((header.position_bytes != 4 && header.position_bytes != 8) || header.file_size > file.size) {
+			std::cerr << "ERROR::SNAPSHOT::TRUNCATED " << path << std::endl;
+			return false;
+		}
+		// the columns have to lie where this version puts them, a count too large for the file can't pass either
+		SnapshotHeader expected = header;
+		bool consistent = header.count <= file.size / 4 && header.next_id >= 0 && header.next_id <= INT32_MAX;
+		if (consistent) {
+			layout(expected);
+			consistent = expected.file_size == header.file_size
+				&& std::memcmp(expected.offset, header.offset, sizeof(header.offset)) == 0;
+		}
+		if (!consistent) {
+			std::cerr << "ERROR::SNAPSHOT::CORRUPT_LAYOUT " << path << std::endl;
+			return false;
+		}
+		// the rungs are shift counts in BlockTimesteps, the enums pick the branches of every mode switch
+		if (header.block_max_rung < 0 || header.block_max_rung >= 31 || header.timestep_mode > (uint32_t)TimestepMode::block
+			|| header.solver > (uint32_t)ForceSolver::direct) {
+			std::cerr << "ERROR::SNAPSHOT::BAD_SETTINGS " << path << std::endl;
+			return false;
+		}
+		header.integrator[sizeof(header.integrator) - 1] = '\0';
+		bool started = (header.flags & 1u) != 0;
+		bool restart = std::strcmp(header.integrator, System::integrator_t::name()) != 0;
+		if (restart && started && !known_integrator(header.integrator)) {
+			std::cerr << "ERROR::SNAPSHOT::UNKNOWN_INTEGRATOR " << header.integrator << " " << path << std::endl;
+			return false;
+		}
+		if (restart) {
+			std::cerr << "WARNING::SNAPSHOT::INTEGRATOR written with " << header.integrator
+				<< ", restarting with " << System::integrator_t::name() << std::endl;
+		}
+
+		const float* position_f = (const float*)(base + header.offset[snapshot_position]);
+		const double* position_d = (const double*)(base + header.offset[snapshot_position]);
+		const float* velocity = (const float*)(base + header.offset[snapshot_velocity]);
+		const float* acceleration = (const float*)(base + header.offset[snapshot_acceleration]);
+		const float* mass = (const float*)(base + header.offset[snapshot_mass]);
+		const float* radius = (const float*)(base + header.offset[snapshot_radius]);
+		const float* dt = (const float*)(base + header.offset[snapshot_dt]);
+		const int32_t* id = (const int32_t*)(base + header.offset[snapshot_id]);
+		const int32_t* rung = (const int32_t*)(base + header.offset[snapshot_rung]);
+
+		size_t count = (size_t)header.count;
+
+		// ids have to be below next_id and unique, rungs in 0 .. max_rung, checked before the system is touched
+		std::unordered_map<int, int> id_index;
+		id_index.reserve(count);
+		for (size_t i = 0; i < count; i++) {
+			if (id[i] < 0 || id[i] >= header.next_id || !id_index.emplace(id[i], (int)i).second) {
+				std::cerr << "ERROR::SNAPSHOT::BAD_ID " << id[i] << " " << path << std::endl;
+				return false;
+			}
+			if (rung[i] < 0 || rung[i] > header.block_max_rung) {
+				std::cerr << "ERROR::SNAPSHOT::BAD_RUNG " << rung[i] << " " << path << std::endl;
+				return false;
+			}
+		}
+
+		s.particles.assign(count, particle_t(0.f, glm::vec3(0.f), glm::vec3(0.f)));
+
+		parallel(count, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				particle_t& p = s.particles[i];
+				if (header.position_bytes == 8) {
+					p.position = position_t(glm::dvec3(position_d[3 * i], position_d[3 * i + 1], position_d[3 * i + 2]));
+				}
+				else {
+					p.position = position_t(glm::vec3(position_f[3 * i], position_f[3 * i + 1], position_f[3 * i + 2]));
+				}
+				p.velocity = glm::vec3(velocity[3 * i], velocity[3 * i + 1], velocity[3 * i + 2]);
+				p.acceleration = glm::vec3(acceleration[3 * i], acceleration[3 * i + 1], acceleration[3 * i + 2]);
+				p.new_acceleration = glm::vec3(0.f);
+				p.mass = mass[i];
+				p.radius = radius[i];
+				p.scale = glm::vec3(radius[i]);
+				p.dt = dt[i];
+				p.id = id[i];
+				p.rung = rung[i];
+
+				// another integrator can't continue the staggered state, it starts over from the synchronised one
+				if (restart && started) {
+					synchronize_saved(header.integrator, p, header.dt);
+				}
+			}
+		});
+
+		s.amount = (int)count;
+		s.next_id = (int)header.next_id;
+		s.id_index.swap(id_index);
+		s.free_slots.clear();
+
+		s.time = header.time;
+		s.step_count = header.step;
+		s.dt = header.dt;
+		// the saved dt is the one of the last step
+		s.dt_prev = header.dt;
+		s.timestep_mode = (TimestepMode)header.timestep_mode;
+		s.solver = (ForceSolver)header.solver;
+		s.integrator_started = started && !restart;
+		s.block.started = (header.flags & 2u) != 0;
+		s.block.dt_max = header.block_dt_max;
+		s.block.max_rung = header.block_max_rung;
+		s.Qtree.theta = header.theta;
+		s.Qtree.softening = header.softening;
+		s.Qtree.gravitational_constant = header.gravitational_constant;
+		return true;
+	}
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+#include <chrono>
+#include <glm/glm.hpp>
+
+
+enum class TimestepMode {
+	fixed,		// one global dt, 1/120 by default
+	adaptive,	// one global dt, chosen every step by AdaptiveTimestep
+	block		// power of two block timesteps, see BlockTimesteps
+};
+
+// global timestep from the fastest / most accelerated particle of the last force pass
+// the maxima are collected by the force threads while they walk the tree, so this costs no extra sweep
+struct AdaptiveTimestep {
+	float eta_acceleration;	// dt <= eta_acceleration * sqrt(softening / max|a|)
+	float courant;			// dt <= courant * softening / max|v|, nobody moves further than a fraction of the softening
+	float softening;
+	float max_growth;		// dt grows at most by this factor per step, shrinking is immediate
+	float dt_min;
+	float dt_max;
+
+	AdaptiveTimestep() : eta_acceleration(0.05f), courant(0.25f), softening(0.1f), max_growth(1.25f), dt_min(1e-6f), dt_max(1.f / 30.f) {};
+
+	float next_dt(float dt, float max_acceleration, float max_velocity) const {
+		float wanted = dt_max;
+
+		if (max_acceleration > 0.f) {
+			wanted = glm::min(wanted, eta_acceleration * sqrtf(softening / max_acceleration));
+		}
+		if (max_velocity > 0.f) {
+			wanted = glm::min(wanted, courant * softening / max_velocity);
+		}
+
+		wanted = glm::min(wanted, dt * max_growth);
+		return glm::clamp(wanted, dt_min, dt_max);
+	}
+};
+
+// how much simulated time one wall clock second buys, to compare configurations honestly
+struct StepCost {
+	double simulated_time;
+	double wall_time;
+	long long steps;
+
+	std::chrono::steady_clock::time_point step_start;
+
+	StepCost() : simulated_time(0.0), wall_time(0.0), steps(0) {};
+
+	void begin() {
+		step_start = std::chrono::steady_clock::now();
+	}
+
+	void end(double simulated) {
+		wall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - step_start).count();
+		simulated_time += simulated;
+		steps++;
+	}
+
+	double simulated_per_wall_second() const {
+		return wall_time > 0.0 ? simulated_time / wall_time : 0.0;
+	}
+
+	void reset() {
+		simulated_time = 0.0;
+		wall_time = 0.0;
+		steps = 0;
+	}
+};
+
+/* hierarchical / block timesteps
+	rung r steps with dt_max / 2^r, one update() advances the system by dt_max in 2^max_rung substeps
+	a particle on rung r is active every 2^(max_rung - r) substeps, only active particles get new forces
+
+	substep:  1 2 3 4 5 6 7 8
+	rung 0:                 x
+	rung 1:         x       x
+	rung 2:     x   x   x   x
+	rung 3:   x x x x x x x x
+*/
+struct BlockTimesteps {
+	float dt_max;
+	int max_rung;
+	float eta; //accuracy parameter of the timestep criterion
+	float softening; //length scale for the acceleration criterion
+
+	int rebuild_rung; //the tree is only rebuilt on substeps where this rung or a coarser one is active, refitted on the others
+
+	bool started;
+	long long force_evaluations; //number of particle force calculations, to compare with fixed steps
+	long long rebuilds;
+	long long refits;
+
+	BlockTimesteps() : dt_max(1.f / 120.f), max_rung(6), eta(0.02f), softening(0.1f), rebuild_rung(2), started(false),
+		force_evaluations(0), rebuilds(0), refits(0) {};
+
+	int substeps() const {
+		return 1 << max_rung;
+	}
+
+	float dt_min() const {
+		return dt_max / substeps();
+	}
+
+	float dt_of(int rung) const {
+		return dt_max / (float)(1 << rung);
+	}
+
+	// length of a step of the rung in substeps
+	int stride(int rung) const {
+		return 1 << (max_rung - rung);
+	}
+
+	// true if a particle on this rung finishes its step at the end of the substep (counted from 0)
+	bool is_active(int rung, int substep) const {
+		return (substep + 1) % stride(rung) == 0;
+	}
+
+	bool rebuild_due(int substep) const {
+		return is_active(glm::min(rebuild_rung, max_rung), substep);
+	}
+
+	// desired timestep: eta * min(sqrt(softening / |a|), |a| / |jerk|), the jerk term is skipped when unknown
+	int rung_for(const glm::vec3& acceleration, const glm::vec3& jerk) const {
+		float a = glm::length(acceleration);
+		if (a == 0.f) {
+			return 0;
+		}
+		float dt = eta * sqrtf(softening / a);
+
+		float j = glm::length(jerk);
+		if (j > 0.f) {
+			dt = glm::min(dt, eta * a / j);
+		}
+
+		if (dt >= dt_max) {
+			return 0;
+		}
+		int rung = (int)ceilf(log2f(dt_max / dt));
+		return glm::min(rung, max_rung);
+	}
+
+	// a particle may always go to a smaller step, but only to a larger one if the new step is in sync with the grid
+	int allowed_rung(int old_rung, int wanted_rung, int substep) const {
+		if (wanted_rung >= old_rung) {
+			return wanted_rung;
+		}
+		// at most one rung per step, and only if the coarser step starts here
+		int coarser = old_rung - 1;
+		if ((substep + 1) % stride(coarser) == 0) {
+			return coarser;
+		}
+		return old_rung;
+	}
+};
@@ -0,0 +1,574 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+#include "trajectory_frame.h"
+
+
+/* lossy compression of trajectory frames, frames go in and come out in the raw layout of TrajectoryWriter
+	1. quantise: positions and velocities become integers on a fixed grid of 2 * tolerance, so the error of every
+	   coordinate stays below the tolerance and never accumulates, a planar position can be off by sqrt(2) * tolerance,
+	   masses keep their bits, ids are exact
+	2. delta: a keyframe stores every value against the one of the particle before it in the same chunk,
+	   the frames in between store the change since the previous frame, integer differences so decoding is exact
+	3. entropy coding: every difference is split into its bit length and the bits below the leading one,
+	   the bit lengths are rANS coded with the frequencies of the chunk, the low bits are stored as they are
+	the particles are cut into chunks of chunk_size (at most max_chunk_size) that are coded independently, on thread_count threads
+	frames depend on the one before, a new keyframe starts every keyframe_interval frames or when the count changes
+	single precision positions are rounded to float after decoding, which can add float resolution to the error
+*/
+struct TrajectoryCodec {
+
+	float position_tolerance;
+	float velocity_tolerance;
+	int keyframe_interval;
+	size_t chunk_size; //particles per chunk
+	int thread_count;
+
+	// quantised values of the last frame, one vector per field, the state of the delta coding
+	std::vector<int64_t> previous[4];
+	uint32_t previous_fields;
+	uint64_t previous_count;
+	long long frames;
+
+	long long raw_bytes;
+	long long encoded_bytes;
+
+	static const int scale_bits = 12;
+	static const uint32_t scale = 1u << scale_bits;
+	static const uint32_t rans_low = 1u << 23;
+	static const int symbols = 65; //bit lengths 0 .. 64
+	// a chunk of constant values codes to a few bytes, the cap is what keeps the particle count of a frame
+	// proportional to its size, the decoder rejects larger chunks before it allocates anything
+	static const size_t max_chunk_size = 1 << 16;
+
+	TrajectoryCodec(float position_tol = 1e-3f, float velocity_tol = 1e-4f) :
+		position_tolerance(position_tol), velocity_tolerance(velocity_tol), keyframe_interval(32), chunk_size(1 << 16),
+		thread_count(4), previous_fields(0), previous_count(0), frames(0), raw_bytes(0), encoded_bytes(0) {};
+
+	// starts over with a keyframe, after seeking or when a frame was lost
+	void reset() {
+		previous_fields = 0;
+		previous_count = 0;
+		frames = 0;
+	}
+
+	double ratio() const {
+		return encoded_bytes > 0 ? (double)raw_bytes / encoded_bytes : 0.0;
+	}
+
+	static int bit_length(uint64_t u) {
+		if (u == 0) {
+			return 0;
+		}
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, u);
+		return (int)index + 1;
+#elif defined(__GNUC__)
+		return 64 - __builtin_clzll(u);
+#else
+		int n = 0;
+		while (u != 0) {
+			u >>= 1;
+			n++;
+		}
+		return n;
+#endif
+	}
+
+	static uint64_t zigzag(int64_t r) {
+		return ((uint64_t)r << 1) ^ (uint64_t)(r >> 63);
+	}
+
+	static int64_t unzigzag(uint64_t u) {
+		return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	}
+
+	// one chunk of one field, a task for the worker threads
+	struct Task {
+		unsigned field;
+		size_t begin; //first value, not particle
+		size_t end;
+		std::vector<char> blob;
+	};
+
+	static std::vector<Task> make_tasks(uint32_t fields, uint64_t count, size_t chunk_size) {
+		std::vector<Task> tasks;
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			if (!(fields & field)) {
+				continue;
+			}
+			size_t values = (size_t)count * TrajectoryFrameHeader::components(field);
+			size_t step = chunk_size * TrajectoryFrameHeader::components(field);
+			size_t begin = 0;
+			do {
+				Task task;
+				task.field = field;
+				task.begin = begin;
+				task.end = glm::min(values, begin + step);
+				tasks.push_back(task);
+				begin += step;
+			} while (begin < values);
+		}
+		return tasks;
+	}
+
+	// runs f(task) for every task, tasks handed out round robin
+	template<typename F>
+	void parallel(std::vector<Task>& tasks, const F& f) const {
+		std::vector<std::thread> threads;
+		for (int t = 0; t < thread_count; t++) {
+			threads.emplace_back([&, t]() {
+				for (size_t k = t; k < tasks.size(); k += thread_count) {
+					f(tasks[k]);
+				}
+			});
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+	}
+
+	// raw frame from TrajectoryWriter to an encoded frame, the header is kept with encoding = 1
+	void encode(const std::vector<char>& raw, std::vector<char>& out) {
+		TrajectoryFrameHeader header;
+		std::memcpy(&header, raw.data(), sizeof(header));
+		char* column[4];
+		header.columns(const_cast<char*>(raw.data()), column);
+
+		bool keyframe = frames % keyframe_interval == 0 || header.fields != previous_fields || header.count != previous_count;
+		header.encoding = 1;
+		header.keyframe = keyframe ? 1 : 0;
+		header.position_tolerance = position_tolerance;
+		header.velocity_tolerance = velocity_tolerance;
+
+		std::vector<int64_t> current[4];
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			if (header.fields & field) {
+				current[TrajectoryFrameHeader::field_index(field)].resize((size_t)header.count * TrajectoryFrameHeader::components(field));
+			}
+		}
+
+		size_t frame_chunk_size = glm::clamp<size_t>(chunk_size, 1, max_chunk_size);
+		std::vector<Task> tasks = make_tasks(header.fields, header.count, frame_chunk_size);
+		parallel(tasks, [&](Task& task) {
+			int f = TrajectoryFrameHeader::field_index(task.field);
+			quantise(header, task.field, column[f], task.begin, task.end, current[f].data());
+			encode_chunk(current[f].data(), keyframe ? nullptr : previous[f].data(), task.begin, task.end, TrajectoryFrameHeader::components(task.field), task.blob);
+		});
+
+		write_frame(header, frame_chunk_size, tasks, out);
+
+		for (int f = 0; f < 4; f++) {
+			previous[f].swap(current[f]);
+		}
+		previous_fields = header.fields;
+		previous_count = header.count;
+		frames++;
+		raw_bytes += raw.size();
+		encoded_bytes += out.size();
+	}
+
+	bool decode(const std::vector<char>& encoded, std::vector<char>& raw) {
+		return decode(encoded.data(), encoded.size(), raw);
+	}
+
+	// encoded frame back to the raw layout, frames have to come in order starting with a keyframe
+	// raw frames are copied as they are
+	// the frame may come straight from a file, every size and offset in it is checked before it is used
+	bool decode(const char* encoded, size_t size, std::vector<char>& raw) {
+		TrajectoryFrameHeader header;
+		if (size < sizeof(header)) {
+			std::cerr << "ERROR::TRAJECTORY::TRUNCATED" << std::endl;
+			return false;
+		}
+		std::memcpy(&header, encoded, sizeof(header));
+		if (!header.plausible() || header.bytes > size) {
+			std::cerr << "ERROR::TRAJECTORY::CORRUPT at step " << header.step << std::endl;
+			return false;
+		}
+		if (header.encoding != 1) {
+			raw.assign(encoded, encoded + size);
+			return true;
+		}
+		if (!header.keyframe && (header.fields != previous_fields || header.count != previous_count)) {
+			std::cerr << "ERROR::TRAJECTORY::MISSING_KEYFRAME at step " << header.step << std::endl;
+			return false;
+		}
+
+		// chunk size and the table of blob sizes right after the header
+		size_t table_offset = TrajectoryFrameHeader::align(sizeof(TrajectoryFrameHeader));
+		const char* table = encoded + table_offset;
+		uint64_t frame_chunk_size = 0;
+		if (size >= table_offset + sizeof(uint64_t)) {
+			std::memcpy(&frame_chunk_size, table, sizeof(uint64_t));
+		}
+		if (frame_chunk_size == 0 || frame_chunk_size > max_chunk_size) {
+			std::cerr << "ERROR::TRAJECTORY::CORRUPT at step " << header.step << std::endl;
+			return false;
+		}
+		// one table entry per chunk and field, the table has to fit before the tasks are made
+		uint64_t chunks = glm::max<uint64_t>(1, (header.count + frame_chunk_size - 1) / frame_chunk_size);
+		if (chunks > size / sizeof(uint64_t)) {
+			std::cerr << "ERROR::TRAJECTORY::TRUNCATED at step " << header.step << std::endl;
+			return false;
+		}
+		std::vector<Task> tasks = make_tasks(header.fields, header.count, (size_t)glm::min(frame_chunk_size, header.count + 1));
+		size_t blobs_offset = table_offset + TrajectoryFrameHeader::align((tasks.size() + 1) * sizeof(uint64_t));
+		if (blobs_offset > size) {
+			std::cerr << "ERROR::TRAJECTORY::TRUNCATED at step " << header.step << std::endl;
+			return false;
+		}
+		std::vector<const char*> blob(tasks.size());
+		std::vector<uint64_t> blob_size(tasks.size());
+		size_t left = size - blobs_offset;
+		const char* at = encoded + blobs_offset;
+		for (size_t k = 0; k < tasks.size(); k++) {
+			std::memcpy(&blob_size[k], table + (k + 1) * sizeof(uint64_t), sizeof(uint64_t));
+			if (blob_size[k] > left) {
+				std::cerr << "ERROR::TRAJECTORY::TRUNCATED at step " << header.step << std::endl;
+				return false;
+			}
+			blob[k] = at;
+			at += blob_size[k];
+			left -= (size_t)blob_size[k];
+		}
+
+		// the raw frame has the same header, only the encoding changes
+		// allocated only now, count is bounded by the size of the frame through the chunk table
+		size_t total = header.raw_bytes();
+		raw.assign(total, 0);
+		TrajectoryFrameHeader raw_header = header;
+		raw_header.encoding = 0;
+		raw_header.keyframe = 0;
+		raw_header.bytes = total;
+		std::memcpy(raw.data(), &raw_header, sizeof(raw_header));
+		char* column[4];
+		header.columns(raw.data(), column);
+
+		std::vector<int64_t> current[4];
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			if (header.fields & field) {
+				current[TrajectoryFrameHeader::field_index(field)].resize((size_t)header.count * TrajectoryFrameHeader::components(field));
+			}
+		}
+
+		std::vector<char> ok(tasks.size(), 0);
+		parallel(tasks, [&](Task& task) {
+			size_t k = &task - tasks.data();
+			int f = TrajectoryFrameHeader::field_index(task.field);
+			ok[k] = decode_chunk(blob[k], (size_t)blob_size[k], header.keyframe ? nullptr : previous[f].data(), task.begin, task.end, TrajectoryFrameHeader::components(task.field), current[f].data());
+			if (ok[k]) {
+				dequantise(header, task.field, current[f].data(), task.begin, task.end, column[f]);
+			}
+		});
+		if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+			std::cerr << "ERROR::TRAJECTORY::CORRUPT at step " << header.step << std::endl;
+			return false;
+		}
+
+		for (int f = 0; f < 4; f++) {
+			previous[f].swap(current[f]);
+		}
+		previous_fields = header.fields;
+		previous_count = header.count;
+		return true;
+	}
+
+	// raw column values begin .. end - 1 to integers
+	void quantise(const TrajectoryFrameHeader& header, unsigned field, const char* column, size_t begin, size_t end, int64_t* q) const {
+		switch (field) {
+		case trajectory_position: {
+			double inverse = 1.0 / (2.0 * position_tolerance);
+			for (size_t i = begin; i < end; i++) {
+				double x = header.position_bytes == 8 ? ((const double*)column)[i] : ((const float*)column)[i];
+				q[i] = (int64_t)std::llround(x * inverse);
+			}
+			return;
+		}
+		case trajectory_velocity: {
+			double inverse = 1.0 / (2.0 * velocity_tolerance);
+			for (size_t i = begin; i < end; i++) {
+				q[i] = (int64_t)std::llround(((const float*)column)[i] * inverse);
+			}
+			return;
+		}
+		case trajectory_mass:
+			for (size_t i = begin; i < end; i++) {
+				uint32_t bits;
+				std::memcpy(&bits, column + 4 * i, 4);
+				q[i] = bits;
+			}
+			return;
+		case trajectory_id:
+			for (size_t i = begin; i < end; i++) {
+				q[i] = ((const int32_t*)column)[i];
+			}
+			return;
+		}
+	}
+
+	static void dequantise(const TrajectoryFrameHeader& header, unsigned field, const int64_t* q, size_t begin, size_t end, char* column) {
+		switch (field) {
+		case trajectory_position: {
+			double step = 2.0 * header.position_tolerance;
+			for (size_t i = begin; i < end; i++) {
+				if (header.position_bytes == 8) {
+					((double*)column)[i] = q[i] * step;
+				}
+				else {
+					((float*)column)[i] = (float)(q[i] * step);
+				}
+			}
+			return;
+		}
+		case trajectory_velocity: {
+			double step = 2.0 * header.velocity_tolerance;
+			for (size_t i = begin; i < end; i++) {
+				((float*)column)[i] = (float)(q[i] * step);
+			}
+			return;
+		}
+		case trajectory_mass:
+			for (size_t i = begin; i < end; i++) {
+				uint32_t bits = (uint32_t)q[i];
+				std::memcpy(column + 4 * i, &bits, 4);
+			}
+			return;
+		case trajectory_id:
+			for (size_t i = begin; i < end; i++) {
+				((int32_t*)column)[i] = (int32_t)q[i];
+			}
+			return;
+		}
+	}
+
+	// header, chunk size, table of blob sizes, blobs, padded to 64 bytes
+	static void write_frame(TrajectoryFrameHeader& header, uint64_t chunk_size, const std::vector<Task>& tasks, std::vector<char>& out) {
+		size_t table = TrajectoryFrameHeader::align((tasks.size() + 1) * sizeof(uint64_t));
+		size_t total = TrajectoryFrameHeader::align(sizeof(TrajectoryFrameHeader)) + table;
+		for (const Task& task : tasks) {
+			total += task.blob.size();
+		}
+		total = TrajectoryFrameHeader::align(total);
+		header.bytes = total;
+
+		out.assign(total, 0);
+		std::memcpy(out.data(), &header, sizeof(header));
+		char* at = out.data() + TrajectoryFrameHeader::align(sizeof(TrajectoryFrameHeader));
+		char* blob = at + table;
+		std::memcpy(at, &chunk_size, sizeof(chunk_size));
+		for (size_t k = 0; k < tasks.size(); k++) {
+			uint64_t size = tasks[k].blob.size();
+			std::memcpy(at + (k + 1) * sizeof(uint64_t), &size, sizeof(size));
+			if (size > 0) {
+				std::memcpy(blob, tasks[k].blob.data(), (size_t)size);
+			}
+			blob += size;
+		}
+	}
+
+	// frequencies of the bit lengths scaled to add up to scale, every used length keeps at least 1
+	static void normalise(const uint32_t count[symbols], size_t total, uint32_t freq[symbols]) {
+		uint32_t sum = 0;
+		int largest = 0;
+		for (int s = 0; s < symbols; s++) {
+			freq[s] = count[s] == 0 ? 0 : glm::max(1u, (uint32_t)((uint64_t)count[s] * scale / total));
+			sum += freq[s];
+			if (freq[s] > freq[largest]) {
+				largest = s;
+			}
+		}
+		while (sum > scale) {
+			int s = largest;
+			for (int k = 0; k < symbols; k++) {
+				if (freq[k] > freq[s]) {
+					s = k;
+				}
+			}
+			freq[s]--;
+			sum--;
+		}
+		freq[largest] += scale - sum;
+	}
+
+	/* blob of one chunk
+		u8 number of bit lengths k, u16 frequencies[k], u32 size of the rans stream, rans stream, low bits
+	*/
+	static void encode_chunk(const int64_t* q, const int64_t* previous, size_t begin, size_t end, int stride, std::vector<char>& blob) {
+		size_t n = end - begin;
+		std::vector<uint64_t> u(n);
+		std::vector<uint8_t> length(n);
+		uint32_t count[symbols] = {};
+		int used = 0;
+
+		for (size_t k = 0; k < n; k++) {
+			size_t i = begin + k;
+			int64_t reference = previous != nullptr ? previous[i] : (k >= (size_t)stride ? q[i - stride] : 0);
+			u[k] = zigzag(q[i] - reference);
+			length[k] = (uint8_t)bit_length(u[k]);
+			count[length[k]]++;
+			used = glm::max(used, length[k] + 1);
+		}
+
+		uint32_t freq[symbols], start[symbols];
+		normalise(count, glm::max<size_t>(n, 1), freq);
+		uint32_t cumulative = 0;
+		for (int s = 0; s < symbols; s++) {
+			start[s] = cumulative;
+			cumulative += freq[s];
+		}
+
+		// rans runs backwards, the bytes are collected reversed and turned around at the end
+		std::vector<uint8_t> rans;
+		rans.reserve(n / 2 + 16);
+		uint32_t x = rans_low;
+		for (size_t k = n; k-- > 0;) {
+			uint32_t f = freq[length[k]];
+			uint32_t x_max = ((rans_low >> scale_bits) << 8) * f;
+			while (x >= x_max) {
+				rans.push_back((uint8_t)(x & 0xff));
+				x >>= 8;
+			}
+			x = ((x / f) << scale_bits) + (x % f) + start[length[k]];
+		}
+		rans.push_back((uint8_t)(x >> 24));
+		rans.push_back((uint8_t)(x >> 16));
+		rans.push_back((uint8_t)(x >> 8));
+		rans.push_back((uint8_t)x);
+		std::reverse(rans.begin(), rans.end());
+
+		blob.clear();
+		blob.reserve(3 + 2 * used + rans.size() + n * 2);
+		blob.push_back((char)used);
+		for (int s = 0; s < used; s++) {
+			uint16_t f = (uint16_t)freq[s];
+			blob.push_back((char)(f & 0xff));
+			blob.push_back((char)(f >> 8));
+		}
+		uint32_t rans_size = (uint32_t)rans.size();
+		for (int b = 0; b < 4; b++) {
+			blob.push_back((char)(rans_size >> (8 * b)));
+		}
+		blob.insert(blob.end(), rans.begin(), rans.end());
+
+		// the bits below the leading one, it is implied by the length
+		uint64_t acc = 0;
+		int bits = 0;
+		for (size_t k = 0; k < n; k++) {
+			int low = length[k] > 0 ? length[k] - 1 : 0;
+			uint64_t value = u[k];
+			while (low > 0) {
+				int take = glm::min(low, 32);
+				acc |= (value & ((1ull << take) - 1)) << bits;
+				value >>= take;
+				bits += take;
+				low -= take;
+				while (bits >= 8) {
+					blob.push_back((char)(acc & 0xff));
+					acc >>= 8;
+					bits -= 8;
+				}
+			}
+		}
+		if (bits > 0) {
+			blob.push_back((char)(acc & 0xff));
+		}
+	}
+
+	// false if the blob does not hold a valid chunk, nothing outside of it is ever read
+	static bool decode_chunk(const char* blob, size_t size, const int64_t* previous, size_t begin, size_t end, int stride, int64_t* q) {
+		const uint8_t* in = (const uint8_t*)blob;
+		const uint8_t* in_end = in + size;
+		size_t n = end - begin;
+		if (n == 0) {
+			return true;
+		}
+
+		if (size < 1) {
+			return false;
+		}
+		int used = *in++;
+		if (used > symbols || (size_t)(in_end - in) < 2 * (size_t)used + 4) {
+			return false;
+		}
+		uint32_t freq[symbols] = {}, start[symbols];
+		for (int s = 0; s < used; s++) {
+			freq[s] = in[0] | (in[1] << 8);
+			in += 2;
+		}
+		uint32_t cumulative = 0;
+		for (int s = 0; s < symbols; s++) {
+			cumulative += freq[s];
+		}
+		if (cumulative != scale) {
+			return false;
+		}
+		cumulative = 0;
+		std::vector<uint8_t> slot_symbol(scale);
+		for (int s = 0; s < symbols; s++) {
+			start[s] = cumulative;
+			for (uint32_t k = 0; k < freq[s]; k++) {
+				slot_symbol[cumulative + k] = (uint8_t)s;
+			}
+			cumulative += freq[s];
+		}
+		uint32_t rans_size = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+		in += 4;
+		if (rans_size < 4 || rans_size > (size_t)(in_end - in)) {
+			return false;
+		}
+		const uint8_t* rans = in;
+		const uint8_t* rans_end = in + rans_size;
+		const uint8_t* bit_in = rans_end;
+
+		uint32_t x = rans[0] | (rans[1] << 8) | (rans[2] << 16) | ((uint32_t)rans[3] << 24);
+		rans += 4;
+
+		uint64_t acc = 0;
+		int bits = 0;
+		for (size_t k = 0; k < n; k++) {
+			uint32_t slot = x & (scale - 1);
+			int length = slot_symbol[slot];
+			x = freq[length] * (x >> scale_bits) + slot - start[length];
+			while (x < rans_low) {
+				if (rans == rans_end) {
+					return false;
+				}
+				x = (x << 8) | *rans++;
+			}
+
+			uint64_t u = 0;
+			if (length > 0) {
+				int low = length - 1;
+				int shift = 0;
+				while (low > 0) {
+					int take = glm::min(low, 32);
+					while (bits < take) {
+						acc |= (uint64_t)(bit_in < in_end ? *bit_in++ : 0) << bits;
+						bits += 8;
+					}
+					u |= (acc & ((1ull << take) - 1)) << shift;
+					acc >>= take;
+					bits -= take;
+					shift += take;
+					low -= take;
+				}
+				u |= 1ull << (length - 1);
+			}
+
+			size_t i = begin + k;
+			int64_t reference = previous != nullptr ? previous[i] : (k >= (size_t)stride ? q[i - stride] : 0);
+			q[i] = reference + unzigzag(u);
+		}
+		return true;
+	}
+};
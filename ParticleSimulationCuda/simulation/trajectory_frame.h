@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+// which fields go into a trajectory frame, or-ed together
+enum TrajectoryField {
+	trajectory_position = 1,	// 3 * float or 3 * double, like the simulation
+	trajectory_velocity = 2,	// 3 * float
+	trajectory_mass = 4,		// float
+	trajectory_id = 8			// int32
+};
+
+/* one frame in the file, every frame starts on a 64 byte boundary
+	raw frames: header, then one column per field in the order of TrajectoryField, every column padded to 64 bytes
+	encoded frames: header, then the chunks of trajectory_codec.h
+	bytes is the size of the whole frame including the header, so a reader can skip frames
+*/
+struct TrajectoryFrameHeader {
+	char magic[4];				// "TRJF"
+	uint32_t version;
+	uint32_t fields;
+	uint32_t position_bytes;
+	uint64_t count;
+	uint64_t bytes;
+	int64_t step;
+	double time;
+	uint32_t encoding;			// 0 = raw columns, 1 = quantised and entropy coded
+	uint32_t keyframe;			// encoded frames: 1 if it does not depend on the frame before
+	float position_tolerance;	// encoded frames: largest error of each decoded coordinate
+	float velocity_tolerance;
+
+	static size_t align(size_t bytes) {
+		return (bytes + 63) & ~(size_t)63;
+	}
+
+	static int field_index(unsigned field) {
+		return field == trajectory_position ? 0 : field == trajectory_velocity ? 1 : field == trajectory_mass ? 2 : 3;
+	}
+
+	static int components(unsigned field) {
+		return field == trajectory_position || field == trajectory_velocity ? 3 : 1;
+	}
+
+	size_t column_bytes(unsigned field) const {
+		return (size_t)count * components(field) * (field == trajectory_position ? position_bytes : 4);
+	}
+
+	// size of the frame in the raw layout
+	size_t raw_bytes() const {
+		size_t total = align(sizeof(TrajectoryFrameHeader));
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			if (fields & field) {
+				total += align(column_bytes(field));
+			}
+		}
+		return total;
+	}
+
+	// files are read straight from the disk, anything a frame claims about itself is checked before it is used
+	// ids are int32, so a frame never holds more than 2^31 particles, raw frames have to fit their columns
+	bool plausible() const {
+		if ((position_bytes != 4 && position_bytes != 8) || encoding > 1 || count > ((uint64_t)1 << 31) || bytes < sizeof(TrajectoryFrameHeader)) {
+			return false;
+		}
+		return encoding == 1 || raw_bytes() <= bytes;
+	}
+
+	// the columns of a raw frame at base, indexed by field_index, nullptr for fields that are not in it
+	void columns(char* base, char* column[4]) const {
+		char* at = base + align(sizeof(TrajectoryFrameHeader));
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			column[field_index(field)] = nullptr;
+			if (fields & field) {
+				column[field_index(field)] = at;
+				at += align(column_bytes(field));
+			}
+		}
+	}
+};
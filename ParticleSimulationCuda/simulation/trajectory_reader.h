@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <glm/glm.hpp>
+
+#include "particle.h"
+#include "mapped_file.h"
+#include "trajectory_frame.h"
+#include "trajectory_codec.h"
+
+
+/* plays back a file of TrajectoryWriter without simulating
+	the file is memory mapped, opening it only reads the frame headers to build an index of offsets and times
+	a background thread decodes the next frames into particles ahead of the display, up to prefetch frames
+	seek() jumps to any time, encoded frames are decoded from the keyframe before it
+	the particles only carry what the renderers need, a file without masses gives every particle mass 1
+*/
+struct TrajectoryReader {
+
+	struct Entry {
+		size_t offset;
+		int64_t step;
+		double time;
+		bool keyframe;
+	};
+
+	struct Frame {
+		int64_t step;
+		double time;
+		std::vector<Particle> particles;
+
+		Frame() : step(0), time(0.0) {};
+	};
+
+	float particle_radius;
+	size_t prefetch;
+
+	MappedFile file;
+	std::vector<Entry> index;
+
+	std::deque<Frame> ready; //decoded, in order
+	std::vector<Frame> pool; //shown frames, their buffers are reused
+	size_t next; //next frame for the worker
+	long long generation; //changes on every seek, frames decoded before are thrown away
+	bool decoding; //the worker holds a frame that is not in ready yet
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stop;
+	std::thread worker;
+
+	// only touched by the worker
+	TrajectoryCodec codec;
+	size_t decoded; //index + 1 of the last frame the codec saw, 0 = none
+	std::vector<char> raw;
+
+	TrajectoryReader(float radius = 0.01f, size_t ahead = 4) :
+		particle_radius(radius), prefetch(ahead), next(0), generation(0), decoding(false), stop(false), decoded(0) {};
+
+	~TrajectoryReader() {
+		close();
+	}
+
+	// maps the file and indexes the frames, a frame cut off at the end (the run was killed) is left out
+	bool open(const std::string& path) {
+		close();
+		if (!file.open_read(path)) {
+			std::cerr << "ERROR::TRAJECTORY::CANNOT_OPEN " << path << std::endl;
+			return false;
+		}
+
+		const char* base = (const char*)file.data;
+		size_t offset = 0;
+		index.clear();
+		while (offset + sizeof(TrajectoryFrameHeader) <= file.size) {
+			TrajectoryFrameHeader header;
+			std::memcpy(&header, base + offset, sizeof(header));
+			if (std::memcmp(header.magic, "TRJF", 4) != 0 || !header.plausible() || header.bytes > file.size - offset) {
+				break;
+			}
+			Entry entry;
+			entry.offset = offset;
+			entry.step = header.step;
+			entry.time = header.time;
+			entry.keyframe = header.encoding == 0 || header.keyframe != 0;
+			index.push_back(entry);
+			offset += (size_t)header.bytes;
+		}
+		if (index.empty()) {
+			std::cerr << "ERROR::TRAJECTORY::NO_FRAMES " << path << std::endl;
+			file.close();
+			return false;
+		}
+
+		stop = false;
+		next = 0;
+		decoded = 0;
+		codec.reset();
+		worker = std::thread(&TrajectoryReader::run, this);
+		return true;
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		changed.notify_all();
+		if (worker.joinable()) {
+			worker.join();
+		}
+		ready.clear();
+		file.close();
+	}
+
+	size_t frame_count() const {
+		return index.size();
+	}
+
+	double start_time() const {
+		return index.empty() ? 0.0 : index.front().time;
+	}
+
+	double end_time() const {
+		return index.empty() ? 0.0 : index.back().time;
+	}
+
+	// the last frame at or before time, the first one for earlier times
+	size_t find(double time) const {
+		auto it = std::upper_bound(index.begin(), index.end(), time, [](double t, const Entry& e) { return t < e.time; });
+		return it == index.begin() ? 0 : (size_t)(it - index.begin()) - 1;
+	}
+
+	// playback continues from the frame at time, frames already decoded are dropped
+	void seek(double time) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			next = find(time);
+			generation++;
+			while (!ready.empty()) {
+				pool.push_back(std::move(ready.front()));
+				ready.pop_front();
+			}
+		}
+		changed.notify_all();
+	}
+
+	// the next frame into out, its old buffers go back to the pool
+	// wait = false returns false right away if the worker is behind, a display then keeps showing the last frame
+	// at the end of the file it returns false
+	bool next_frame(Frame& out, bool wait = true) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (wait) {
+			changed.wait(lock, [this] { return !ready.empty() || (next >= index.size() && !decoding); });
+		}
+		if (ready.empty()) {
+			return false;
+		}
+		pool.push_back(std::move(out));
+		out = std::move(ready.front());
+		ready.pop_front();
+		lock.unlock();
+		changed.notify_all();
+		return true;
+	}
+
+	void run() {
+		while (true) {
+			Frame frame;
+			size_t k;
+			long long frame_generation;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this] { return stop || (ready.size() < prefetch && next < index.size()); });
+				if (stop) {
+					return;
+				}
+				k = next++;
+				frame_generation = generation;
+				if (!pool.empty()) {
+					frame = std::move(pool.back());
+					pool.pop_back();
+				}
+				decoding = true;
+			}
+
+			bool ok = decode(k, frame);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				decoding = false;
+				if (ok && frame_generation == generation) {
+					ready.push_back(std::move(frame));
+				}
+				else {
+					pool.push_back(std::move(frame));
+				}
+			}
+			changed.notify_all();
+		}
+	}
+
+	// frame k into particles, after a jump the codec first catches up from the keyframe before k
+	bool decode(size_t k, Frame& frame) {
+		if (!index[k].keyframe && decoded != k) {
+			size_t key = k;
+			while (key > 0 && !index[key].keyframe) {
+				key--;
+			}
+			codec.reset();
+			for (size_t j = key; j < k; j++) {
+				if (!decode_raw(j)) {
+					return false;
+				}
+			}
+		}
+		if (!decode_raw(k)) {
+			return false;
+		}
+
+		TrajectoryFrameHeader header;
+		std::memcpy(&header, raw.data(), sizeof(header));
+		char* column[4];
+		header.columns(raw.data(), column);
+
+		size_t count = (size_t)header.count;
+		if (frame.particles.size() != count) {
+			frame.particles.assign(count, Particle(particle_radius, glm::vec3(0.f), glm::vec3(0.f)));
+		}
+		frame.step = header.step;
+		frame.time = header.time;
+
+		const char* position = column[TrajectoryFrameHeader::field_index(trajectory_position)];
+		const float* velocity = (const float*)column[TrajectoryFrameHeader::field_index(trajectory_velocity)];
+		const float* mass = (const float*)column[TrajectoryFrameHeader::field_index(trajectory_mass)];
+		const int32_t* id = (const int32_t*)column[TrajectoryFrameHeader::field_index(trajectory_id)];
+
+		for (size_t i = 0; i < count; i++) {
+			Particle& p = frame.particles[i];
+			if (position != nullptr) {
+				if (header.position_bytes == 8) {
+					const double* d = (const double*)position + 3 * i;
+					p.position = glm::vec3((float)d[0], (float)d[1], (float)d[2]);
+				}
+				else {
+					const float* f = (const float*)position + 3 * i;
+					p.position = glm::vec3(f[0], f[1], f[2]);
+				}
+			}
+			p.velocity = velocity != nullptr ? glm::vec3(velocity[3 * i], velocity[3 * i + 1], velocity[3 * i + 2]) : glm::vec3(0.f);
+			p.mass = mass != nullptr ? mass[i] : 1.f;
+			p.id = id != nullptr ? id[i] : (int)i;
+		}
+		return true;
+	}
+
+	// one frame through the codec into raw
+	bool decode_raw(size_t k) {
+		const char* at = (const char*)file.data + index[k].offset;
+		TrajectoryFrameHeader header;
+		std::memcpy(&header, at, sizeof(header));
+		if (!codec.decode(at, (size_t)header.bytes, raw)) {
+			decoded = 0;
+			return false;
+		}
+		decoded = k + 1;
+		return true;
+	}
+};
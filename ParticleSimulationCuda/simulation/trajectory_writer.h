@@ -0,0 +1,253 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <glm/glm.hpp>
+
+#include "trajectory_frame.h"
+#include "trajectory_codec.h"
+
+
+// what push() does when the writer falls behind and the queue is full
+enum class Backpressure {
+	block,		// wait for the writer, no frame is lost, the simulation slows down to disk speed
+	drop,		// skip the frame
+	decimate	// skip the frame and only take every second one from now on, back to every one once the queue drained
+};
+
+/* streams frames to a file on its own thread
+	push() only copies the selected fields into a recycled buffer and queues it, the buffers go back into a pool
+	after they are written, so in steady state nothing is allocated, the frame writer of the renderer works the same way
+	the writer collects frames into a staging block and writes whole blocks, one large write per block_size bytes
+*/
+struct TrajectoryWriter {
+
+	std::string path;
+	unsigned fields;
+	Backpressure backpressure;
+	size_t max_queued;
+	size_t block_size;
+
+	// set before the first push: frames are encoded on the writer thread, so dropped frames never break the delta chain
+	bool compress;
+	TrajectoryCodec codec;
+	std::vector<char> encoded;
+
+	struct Frame {
+		std::vector<char> bytes;
+	};
+	std::deque<Frame> queue;
+	std::vector<Frame> pool; //written frames, their buffers are reused
+	std::mutex mutex;
+	std::condition_variable queue_changed;
+	bool stop;
+
+	int decimation; //only every decimation-th pushed frame is taken
+	long long offered;
+	long long frames_written;
+	long long frames_dropped; //full queue or thinned out by decimate
+	long long bytes_written;
+
+	FILE* file;
+	std::vector<char> staging;
+	size_t staged;
+	std::thread worker;
+
+	static const uint32_t version = 1;
+
+	TrajectoryWriter(const std::string& p, unsigned f = trajectory_position | trajectory_id, Backpressure b = Backpressure::block,
+		size_t max_q = 8, size_t block = 4 << 20) :
+		path(p), fields(f), backpressure(b), max_queued(max_q), block_size(block), compress(false), stop(false),
+		decimation(1), offered(0), frames_written(0), frames_dropped(0), bytes_written(0), staged(0) {
+
+		file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			std::cerr << "ERROR::TRAJECTORY::CANNOT_OPEN " << path << std::endl;
+			stop = true;
+			return;
+		}
+		// the staging block is the buffer, stdio does not need to copy again
+		setvbuf(file, NULL, _IONBF, 0);
+		staging.resize(block_size);
+		worker = std::thread(&TrajectoryWriter::run, this);
+	}
+
+	~TrajectoryWriter() {
+		finish();
+	}
+
+	// copies the selected fields of the system into a frame and queues it, false if the frame was not taken
+	template<typename System>
+	bool push(const System& s) {
+		using scalar_t = typename System::position_t::value_type;
+
+		if (file == NULL) {
+			return false;
+		}
+
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (offered++ % decimation != 0) {
+				frames_dropped++;
+				return false;
+			}
+			if (queue.size() >= max_queued) {
+				if (backpressure == Backpressure::block) {
+					queue_changed.wait(lock, [this] { return queue.size() < max_queued; });
+				}
+				else {
+					if (backpressure == Backpressure::decimate) {
+						decimation *= 2;
+					}
+					frames_dropped++;
+					return false;
+				}
+			}
+			if (!pool.empty()) {
+				frame = std::move(pool.back());
+				pool.pop_back();
+			}
+		}
+
+		// header and columns, the living particles only
+		size_t count = (size_t)s.alive_count();
+		TrajectoryFrameHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "TRJF", 4);
+		header.version = version;
+		header.fields = fields;
+		header.position_bytes = sizeof(scalar_t);
+		header.count = count;
+		header.bytes = header.raw_bytes();
+		header.step = s.step_count;
+		header.time = s.time;
+		frame.bytes.assign((size_t)header.bytes, 0);
+		std::memcpy(frame.bytes.data(), &header, sizeof(header));
+
+		char* column[4];
+		header.columns(frame.bytes.data(), column);
+		for (unsigned field = 1; field <= trajectory_id; field <<= 1) {
+			if (!(fields & field)) {
+				continue;
+			}
+			char* out_column = column[TrajectoryFrameHeader::field_index(field)];
+			size_t k = 0;
+			for (const auto& p : s.particles) {
+				if (!p.alive) {
+					continue;
+				}
+				switch (field) {
+				case trajectory_position: {
+					scalar_t* out = (scalar_t*)out_column + 3 * k;
+					out[0] = p.position.x; out[1] = p.position.y; out[2] = p.position.z;
+					break;
+				}
+				case trajectory_velocity: {
+					float* out = (float*)out_column + 3 * k;
+					out[0] = p.velocity.x; out[1] = p.velocity.y; out[2] = p.velocity.z;
+					break;
+				}
+				case trajectory_mass:
+					((float*)out_column)[k] = p.mass;
+					break;
+				case trajectory_id:
+					((int32_t*)out_column)[k] = p.id;
+					break;
+				}
+				k++;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(std::move(frame));
+		}
+		queue_changed.notify_all();
+		return true;
+	}
+
+	// writes the remaining frames, the last partial block and closes the file
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stop) {
+				return;
+			}
+			stop = true;
+		}
+		queue_changed.notify_all();
+		worker.join();
+
+		flush_staging();
+		fclose(file);
+		file = NULL;
+	}
+
+	void run() {
+		while (true) {
+			Frame frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queue_changed.wait(lock, [this] { return stop || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				frame = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			if (compress) {
+				codec.encode(frame.bytes, encoded);
+				write(encoded.data(), encoded.size());
+			}
+			else {
+				write(frame.bytes.data(), frame.bytes.size());
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				frames_written++;
+				pool.push_back(std::move(frame));
+				// the writer caught up, take more frames again
+				if (decimation > 1 && queue.size() <= max_queued / 4) {
+					decimation /= 2;
+				}
+			}
+			queue_changed.notify_all();
+		}
+	}
+
+	// appends to the staging block, full blocks go to the file in one write
+	void write(const char* data, size_t bytes) {
+		while (bytes > 0) {
+			size_t n = glm::min(bytes, block_size - staged);
+			std::memcpy(staging.data() + staged, data, n);
+			staged += n;
+			data += n;
+			bytes -= n;
+			if (staged == block_size) {
+				flush_staging();
+			}
+		}
+	}
+
+	void flush_staging() {
+		if (staged == 0) {
+			return;
+		}
+		if (fwrite(staging.data(), 1, staged, file) != staged) {
+			std::cerr << "ERROR::TRAJECTORY::WRITE_FAILED " << path << std::endl;
+		}
+		bytes_written += staged;
+		staged = 0;
+	}
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+
+
+/* moves messages between the ranks of a distributed run, see distributed.h
+	the distributed code only uses rank, size, send(to, bytes) and receive(from, bytes), both false once the peer is gone,
+	messages between two ranks arrive in the order they were sent, any transport with these members plugs in
+
+	SocketTransport: one unix domain socket pair per pair of ranks, the ranks are forked from one process,
+	so it runs on a single machine without any setup, only the connection setup would change for tcp
+	not available on windows, fork_ranks fails there
+*/
+struct SocketTransport {
+
+	int rank;
+	int size;
+	std::vector<int> peers; //socket to every other rank, -1 for this rank
+	std::vector<int> children; //pids, only rank 0 waits for them
+
+	SocketTransport() : rank(0), size(1) {};
+
+	~SocketTransport() {
+		finish();
+	}
+
+	SocketTransport(const SocketTransport&) = delete;
+	SocketTransport& operator=(const SocketTransport&) = delete;
+
+	// forks n - 1 more processes, every process comes back with its own rank, the caller is rank 0
+	// has to be called before any thread is started, only the calling thread survives a fork
+	bool fork_ranks(int n) {
+#ifdef _WIN32
+		std::cerr << "ERROR::TRANSPORT::NO_FORK distributed runs need a posix system" << std::endl;
+		return false;
+#else
+		// socket[i][j] is the end rank i uses to talk to rank j
+		std::vector<std::vector<int>> socket(n, std::vector<int>(n, -1));
+		for (int i = 0; i < n; i++) {
+			for (int j = i + 1; j < n; j++) {
+				int pair[2];
+				if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+					std::cerr << "ERROR::TRANSPORT::SOCKETPAIR" << std::endl;
+					return false;
+				}
+				socket[i][j] = pair[0];
+				socket[j][i] = pair[1];
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+				int on = 1;
+				setsockopt(pair[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+				setsockopt(pair[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+			}
+		}
+
+		size = n;
+		rank = 0;
+		for (int r = 1; r < n; r++) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				std::cerr << "ERROR::TRANSPORT::FORK" << std::endl;
+				return false;
+			}
+			if (pid == 0) {
+				rank = r;
+				children.clear();
+				break;
+			}
+			children.push_back((int)pid);
+		}
+
+		// keep the own ends, close everything else
+		peers.assign(n, -1);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				if (socket[i][j] < 0) {
+					continue;
+				}
+				if (i == rank) {
+					peers[j] = socket[i][j];
+				}
+				else {
+					::close(socket[i][j]);
+				}
+			}
+		}
+		return true;
+#endif
+	}
+
+	// length, then the bytes, false if the peer is gone
+	bool send(int to, const std::vector<char>& bytes) {
+		uint64_t length = bytes.size();
+		return write_all(peers[to], (const char*)&length, sizeof(length)) && write_all(peers[to], bytes.data(), bytes.size());
+	}
+
+	bool receive(int from, std::vector<char>& bytes) {
+		uint64_t length = 0;
+		if (!read_all(peers[from], (char*)&length, sizeof(length))) {
+			return false;
+		}
+		bytes.resize((size_t)length);
+		return read_all(peers[from], bytes.data(), bytes.size());
+	}
+
+	// closes the sockets, rank 0 waits for the other ranks to finish
+	void finish() {
+#ifndef _WIN32
+		for (int& s : peers) {
+			if (s >= 0) {
+				::close(s);
+			}
+			s = -1;
+		}
+		for (int pid : children) {
+			int status;
+			waitpid((pid_t)pid, &status, 0);
+		}
+		children.clear();
+#endif
+	}
+
+	// a peer that exited closes its socket, writing to it must fail here and not raise SIGPIPE,
+	// which would kill this rank before it can report anything
+	static bool write_all(int s, const char* data, size_t bytes) {
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+		const int flags = MSG_NOSIGNAL;
+#else
+		const int flags = 0; //SO_NOSIGPIPE is set on the socket instead
+#endif
+		while (bytes > 0) {
+			ssize_t n = ::send(s, data, bytes, flags);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				std::cerr << "ERROR::TRANSPORT::WRITE" << std::endl;
+				return false;
+			}
+			data += n;
+			bytes -= (size_t)n;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static bool read_all(int s, char* data, size_t bytes) {
+#ifndef _WIN32
+		while (bytes > 0) {
+			ssize_t n = ::read(s, data, bytes);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				std::cerr << "ERROR::TRANSPORT::READ" << std::endl;
+				return false;
+			}
+			data += n;
+			bytes -= (size_t)n;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+};